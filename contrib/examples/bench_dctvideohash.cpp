@@ -0,0 +1,109 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    David Starkweather - dstarkweather@phash.org
+
+*/
+
+#include "phash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+/* time the video hash of each file in each sampling and decode mode, and compare the */
+/* hashes of the fast modes with the reference ones                                   */
+
+typedef struct bench_mode {
+    const char *name;
+    ph_video_sampling sampling;
+    ph_video_decode decode;
+} BenchMode;
+
+static const BenchMode modes[] = {
+    { "all",            PH_VIDEO_SAMPLE_ALL,       PH_VIDEO_DECODE_FULL },
+    { "keyframes",      PH_VIDEO_SAMPLE_KEYFRAMES, PH_VIDEO_DECODE_FULL },
+    { "fast",           PH_VIDEO_SAMPLE_ALL,       PH_VIDEO_DECODE_FAST },
+    { "keyframes+fast", PH_VIDEO_SAMPLE_KEYFRAMES, PH_VIDEO_DECODE_FAST }
+};
+static const int nbmodes = sizeof(modes)/sizeof(modes[0]);
+
+static uint64_t* hash_file(const char *file, const BenchMode &mode, int &len, double &secs){
+    auto start = std::chrono::steady_clock::now();
+    uint64_t *hash = ph_dct_videohash(file, len, mode.sampling, mode.decode);
+    secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return hash;
+}
+
+int main(int argc, char **argv){
+
+    if (argc < 2){
+	printf("usage: %s video [video ...]\n", argv[0]);
+	exit(1);
+    }
+
+    /* totals over the corpus, for each mode */
+    double total_secs[nbmodes] = { 0 };
+    double total_sim[nbmodes] = { 0 };
+    int nbfiles = 0;
+
+    printf("%-14s %8s %8s %8s %8s %8s  file\n", "mode", "version", "hashes", "secs", "speedup", "sim");
+    for (int i=1;i<argc;i++){
+	int len_ref;
+	double secs_ref;
+	uint64_t *ref = hash_file(argv[i], modes[0], len_ref, secs_ref);
+	if (!ref){
+	    printf("unable to hash %s\n", argv[i]);
+	    continue;
+	}
+	nbfiles++;
+	total_secs[0] += secs_ref;
+	total_sim[0] += 1.0;
+	printf("%-14s %8x %8d %8.2f %8.2f %8.3f  %s\n", modes[0].name,
+	       ph_dct_videohash_version(modes[0].sampling, modes[0].decode), len_ref, secs_ref, 1.0, 1.0, argv[i]);
+
+	for (int m=1;m<nbmodes;m++){
+	    int len;
+	    double secs;
+	    uint64_t *hash = hash_file(argv[i], modes[m], len, secs);
+	    if (!hash){
+		printf("%-14s unable to hash %s\n", modes[m].name, argv[i]);
+		continue;
+	    }
+	    double sim = ph_dct_videohash_dist(ref, len_ref, hash, len, 21);
+	    total_secs[m] += secs;
+	    total_sim[m] += sim;
+	    printf("%-14s %8x %8d %8.2f %8.2f %8.3f  %s\n", modes[m].name,
+		   ph_dct_videohash_version(modes[m].sampling, modes[m].decode), len, secs, secs_ref/secs, sim, argv[i]);
+	    free(hash);
+	}
+	free(ref);
+    }
+
+    if (nbfiles > 0){
+	printf("\n%d files\n", nbfiles);
+	printf("%-14s %8s %8s %8s\n", "mode", "secs", "speedup", "mean sim");
+	for (int m=0;m<nbmodes;m++){
+	    printf("%-14s %8.2f %8.2f %8.3f\n", modes[m].name, total_secs[m],
+		   total_secs[0]/total_secs[m], total_sim[m]/nbfiles);
+	}
+    }
+
+    return 0;
+}
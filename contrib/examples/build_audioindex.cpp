@@ -0,0 +1,109 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    David Starkweather - dstarkweather@phash.org
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "phash.h"
+#include "audiohash.h"
+#include "audioindex.h"
+
+/* hash the audio files of a directory and write an index of their hashes, and the names */
+/* of the files in the order of the tracks of the index to indexfile.names               */
+
+int main(int argc, char **argv){
+    if (argc < 3){
+	printf("usage: %s directory indexfile [threads]\n", argv[0]);
+	return -1;
+    }
+
+    const char *dir_name = argv[1];
+    const char *filename = argv[2];
+    int threads = (argc > 3) ? atoi(argv[3]) : 0;
+
+    const int sr = 8000;
+    const int nbchannels = 1;
+
+    int nbfiles = 0;
+    char **files = ph_readfilenames(dir_name, nbfiles);
+    if (!files || nbfiles == 0){
+	printf("unable to read files from directory %s\n", dir_name);
+	return -2;
+    }
+    printf("nbfiles = %d\n", nbfiles);
+
+    DP **hashes = ph_audio_hashes(files, nbfiles, sr, nbchannels, threads);
+    if (!hashes){
+	printf("unable to hash files\n");
+	return -3;
+    }
+
+    /* unreadable files stay in the index as empty tracks, so that track numbers are file numbers */
+    uint32_t **hashlist = (uint32_t**)malloc(nbfiles*sizeof(uint32_t*));
+    int *lengths = (int*)malloc(nbfiles*sizeof(int));
+    for (int i=0;i<nbfiles;i++){
+	hashlist[i] = (uint32_t*)hashes[i]->hash;
+	lengths[i] = hashes[i]->hash_length;
+	if (!hashlist[i]){
+	    printf("unable to hash %s\n", files[i]);
+	}
+    }
+
+    ph_audio_index *index = ph_audio_index_build(hashlist, lengths, nbfiles, threads);
+    if (!index){
+	printf("unable to build index\n");
+	return -4;
+    }
+    if (ph_audio_index_save(index, filename) < 0){
+	printf("unable to save %s\n", filename);
+	return -5;
+    }
+
+    char namesfile[1024];
+    snprintf(namesfile, sizeof(namesfile), "%s.names", filename);
+    FILE *names = fopen(namesfile, "w");
+    if (!names){
+	printf("unable to save %s\n", namesfile);
+	return -6;
+    }
+    for (int i=0;i<nbfiles;i++){
+	fprintf(names, "%s\n", files[i]);
+    }
+    fclose(names);
+
+    printf("indexed %d files in %s\n", nbfiles, filename);
+
+    ph_audio_index_free(index);
+    for (int i=0;i<nbfiles;i++){
+	free(hashes[i]->hash);
+	free(hashes[i]->id);
+	free(hashes[i]);
+	free(files[i]);
+    }
+    free(hashes);
+    free(files);
+    free(hashlist);
+    free(lengths);
+
+    return 0;
+}
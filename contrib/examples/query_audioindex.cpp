@@ -0,0 +1,119 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    David Starkweather - dstarkweather@phash.org
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "phash.h"
+#include "audiohash.h"
+#include "audioindex.h"
+
+/* find the tracks of an index written by build_audioindex that contain each query clip */
+
+int main(int argc, char **argv){
+    if (argc < 3){
+	printf("usage: %s indexfile [-f flips] [-n nbresults] file [file ...]\n", argv[0]);
+	printf("  flips - 0, 1 or 2 bits of difference allowed in the hashes looked up (default 0)\n");
+	return -1;
+    }
+
+    const char *filename = argv[1];
+    int flips = 0;
+    int nbresults = 5;
+    int arg = 2;
+    while (arg + 1 < argc && argv[arg][0] == '-'){
+	if (!strcmp(argv[arg], "-f")){
+	    flips = atoi(argv[arg+1]);
+	} else if (!strcmp(argv[arg], "-n")){
+	    nbresults = atoi(argv[arg+1]);
+	}
+	arg += 2;
+    }
+
+    const int sr = 8000;
+    const int nbchannels = 1;
+    const float threshold = 0.30f;
+    const int block_size = 256;
+
+    ph_audio_index *index = ph_audio_index_open(filename);
+    if (!index){
+	printf("unable to open index %s\n", filename);
+	return -2;
+    }
+
+    std::vector<std::string> names;
+    std::string namesfile = std::string(filename) + ".names";
+    FILE *fnames = fopen(namesfile.c_str(), "r");
+    char line[1024];
+    while (fnames && fgets(line, sizeof(line), fnames)){
+	line[strcspn(line, "\r\n")] = '\0';
+	names.push_back(line);
+    }
+    if (fnames){
+	fclose(fnames);
+    }
+    printf("index %s: %d tracks\n", filename, ph_audio_index_nbtracks(index));
+
+    std::vector<ph_audio_match> matches(nbresults > 0 ? nbresults : 1);
+    float *sigbuf = (float*)malloc(1<<21);
+    int buflen = (1<<21)/sizeof(float);
+    for (;arg<argc;arg++){
+	printf("query: %s\n", argv[arg]);
+	int N = buflen;
+	float *buf = ph_readaudio(argv[arg], sr, nbchannels, sigbuf, N);
+	if (!buf){
+	    printf("could not read audio\n");
+	    continue;
+	}
+	int nbframes = 0;
+	uint32_t *hash = ph_audiohash(buf, N, sr, nbframes);
+	if (buf != sigbuf){
+	    free(buf);
+	}
+	if (!hash || nbframes <= 0){
+	    printf("could not get hash\n");
+	    free(hash);
+	    continue;
+	}
+
+	int nbfound = ph_audio_index_query(index, hash, nbframes, flips, threshold, block_size, matches.data(), (int)matches.size());
+	if (nbfound < 0){
+	    printf("could not complete query\n");
+	}
+	for (int j=0;j<nbfound;j++){
+	    const ph_audio_match &m = matches[j];
+	    const char *name = (m.track < (int)names.size()) ? names[m.track].c_str() : "?";
+	    printf("    %d  %s  offset %.2f s  votes %d  confidence %f\n", j, name,
+		   m.offset*128.0/sr, m.votes, m.confidence);
+	}
+	free(hash);
+    }
+
+    free(sigbuf);
+    ph_audio_index_free(index);
+
+    return 0;
+}
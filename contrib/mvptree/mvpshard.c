@@ -0,0 +1,533 @@
+/*
+
+    MVPTree c library
+    Copyright (C) 2008-2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "mvpshard.h"
+
+typedef struct mvp_shard_t {
+  MVPTree *tree;                  /* local shard, or NULL                                */
+  MVPShardRetrieveFunc retrieve;  /* remote shard, or NULL                               */
+  MVPShardCloseFunc close;
+  void *ctx;
+  pthread_mutex_t lock;           /* mvptree_retrieve() is not reentrant on one tree     */
+} MVPShard;
+
+/* per shard state of one mvpshards_retrieve() call */
+typedef struct mvp_shard_task_t {
+  struct mvp_shard_query_t *query;
+  unsigned int shard;
+  MVPDP **results;
+  float *dists;                   /* distance of each result from the target             */
+  unsigned int nbresults;
+  MVPError error;
+  struct mvp_shard_task_t *next;
+} MVPShardTask;
+
+typedef struct mvp_shard_query_t {
+  MVPDP *target;
+  unsigned int knearest;
+  float radius;
+  unsigned int pending;           /* tasks not yet done                                  */
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} MVPShardQuery;
+
+struct mvp_shards_t {
+  MVPShard *shards;
+  unsigned int nbshards;
+  MVPPartition partition;
+  unsigned int next;              /* next shard for MVP_PARTITION_ROUNDROBIN              */
+  CmpFunc dist;
+  unsigned int branchfactor, pathlength, leafcap;
+  pthread_rwlock_t lock;          /* held shared by queries, exclusive to change shards  */
+
+  /* thread pool */
+  pthread_t *threads;
+  unsigned int nbthreads;
+  MVPShardTask *head, *tail;      /* queue of tasks waiting for a thread                 */
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_cond;
+  int stop;
+};
+
+/* query one shard. target is copied, since mvptree_retrieve() overwrites its path */
+static void run_task(MVPShards *shards, MVPShardTask *task) {
+  MVPShard *shard = &shards->shards[task->shard];
+  MVPShardQuery *query = task->query;
+  MVPDP target = *(query->target);
+  target.path = NULL;
+
+  task->nbresults = 0;
+  task->results = NULL;
+  task->dists = NULL;
+  task->error = MVP_EMPTYTREE;
+  if(shard->tree || shard->retrieve) {
+    pthread_mutex_lock(&shard->lock);
+    if(shard->tree) {
+      task->results = mvptree_retrieve(shard->tree, &target, query->knearest, query->radius, \
+        &task->nbresults, &task->error);
+    } else {
+      task->results = shard->retrieve(shard->ctx, &target, query->knearest, query->radius, \
+        &task->nbresults, &task->error);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  /* distances for the merge, computed on the shard's thread rather than serially in the merge */
+  if(task->results && task->nbresults > 0) {
+    task->dists = (float*)malloc(task->nbresults * sizeof(float));
+    if(task->dists) {
+      unsigned int i;
+      for(i = 0; i < task->nbresults; i++) {
+        task->dists[i] = shards->dist(&target, task->results[i]);
+      }
+    } else {
+      free(task->results);
+      task->results = NULL;
+      task->nbresults = 0;
+      task->error = MVP_MEMALLOC;
+    }
+  }
+  free(target.path);
+
+  pthread_mutex_lock(&query->lock);
+  if(--query->pending == 0) pthread_cond_signal(&query->done);
+  pthread_mutex_unlock(&query->lock);
+}
+
+static void* shard_thread(void *p) {
+  MVPShards *shards = (MVPShards*)p;
+  for(;;) {
+    pthread_mutex_lock(&shards->queue_lock);
+    while(!shards->head && !shards->stop) {
+      pthread_cond_wait(&shards->queue_cond, &shards->queue_lock);
+    }
+    MVPShardTask *task = shards->head;
+    if(!task) {
+      pthread_mutex_unlock(&shards->queue_lock);
+      break;
+    }
+    shards->head = task->next;
+    if(!shards->head) shards->tail = NULL;
+    pthread_mutex_unlock(&shards->queue_lock);
+
+    run_task(shards, task);
+  }
+  return NULL;
+}
+
+MVPShards* mvpshards_alloc(unsigned int nbshards, MVPPartition partition, unsigned int nbthreads, \
+  CmpFunc distance, unsigned int bf, unsigned int p, unsigned int k) {
+  if(nbshards == 0 || !distance) return NULL;
+
+  MVPShards *shards = (MVPShards*)malloc(sizeof(MVPShards));
+  if(!shards) return NULL;
+  shards->shards = (MVPShard*)calloc(nbshards, sizeof(MVPShard));
+  shards->threads = (nbthreads > 0) ? (pthread_t*)malloc(nbthreads * sizeof(pthread_t)) : NULL;
+  if(!shards->shards || (nbthreads > 0 && !shards->threads)) {
+    free(shards->shards);
+    free(shards->threads);
+    free(shards);
+    return NULL;
+  }
+
+  unsigned int i;
+  for(i = 0; i < nbshards; i++) {
+    pthread_mutex_init(&shards->shards[i].lock, NULL);
+  }
+  shards->nbshards = nbshards;
+  shards->partition = partition;
+  shards->next = 0;
+  shards->dist = distance;
+  shards->branchfactor = bf;
+  shards->pathlength = p;
+  shards->leafcap = k;
+  pthread_rwlock_init(&shards->lock, NULL);
+
+  shards->head = shards->tail = NULL;
+  shards->stop = 0;
+  pthread_mutex_init(&shards->queue_lock, NULL);
+  pthread_cond_init(&shards->queue_cond, NULL);
+  shards->nbthreads = 0;
+  for(i = 0; i < nbthreads; i++) {
+    if(pthread_create(&shards->threads[i], NULL, shard_thread, shards) != 0) break;
+    shards->nbthreads++;
+  }
+  return shards;
+}
+
+static void unload_shard(MVPShard *shard, MVPFreeFunc free_func) {
+  if(shard->tree) {
+    mvptree_clear(shard->tree, free_func);
+    free(shard->tree);
+  } else if(shard->retrieve && shard->close) {
+    shard->close(shard->ctx);
+  }
+  shard->tree = NULL;
+  shard->retrieve = NULL;
+  shard->close = NULL;
+  shard->ctx = NULL;
+}
+
+void mvpshards_free(MVPShards *shards, MVPFreeFunc free_func) {
+  if(!shards) return;
+  unsigned int i;
+
+  pthread_mutex_lock(&shards->queue_lock);
+  shards->stop = 1;
+  pthread_cond_broadcast(&shards->queue_cond);
+  pthread_mutex_unlock(&shards->queue_lock);
+  for(i = 0; i < shards->nbthreads; i++) {
+    pthread_join(shards->threads[i], NULL);
+  }
+
+  for(i = 0; i < shards->nbshards; i++) {
+    unload_shard(&shards->shards[i], free_func);
+    pthread_mutex_destroy(&shards->shards[i].lock);
+  }
+  pthread_mutex_destroy(&shards->queue_lock);
+  pthread_cond_destroy(&shards->queue_cond);
+  pthread_rwlock_destroy(&shards->lock);
+  free(shards->threads);
+  free(shards->shards);
+  free(shards);
+}
+
+/* shard index of a datapoint from the leading 32 bits of its first elements */
+static unsigned int shard_of(MVPShards *shards, MVPDP *dp) {
+  if(shards->partition == MVP_PARTITION_ROUNDROBIN) {
+    return shards->next++ % shards->nbshards;
+  }
+
+  uint32_t prefix = 0;
+  unsigned int i;
+  if(dp->data && dp->datalen > 0) {
+    switch(dp->type) {
+    case MVP_BYTEARRAY:
+      for(i = 0; i < 4 && i < dp->datalen; i++) {
+        prefix = (prefix << 8) | ((uint8_t*)dp->data)[i];
+      }
+      break;
+    case MVP_UINT16ARRAY:
+      for(i = 0; i < 2 && i < dp->datalen; i++) {
+        prefix = (prefix << 16) | ((uint16_t*)dp->data)[i];
+      }
+      break;
+    case MVP_UINT32ARRAY:
+      prefix = ((uint32_t*)dp->data)[0];
+      break;
+    case MVP_UINT64ARRAY:
+      prefix = (uint32_t)(((uint64_t*)dp->data)[0] >> 32);
+      break;
+    }
+  }
+  return prefix % shards->nbshards;
+}
+
+MVPError mvpshards_add(MVPShards *shards, MVPDP **points, unsigned int nbpoints) {
+  if(!shards || !points) return MVP_ARGERR;
+  if(nbpoints == 0) return MVP_SUCCESS;
+
+  unsigned int i, s, *assign = (unsigned int*)malloc(nbpoints * sizeof(unsigned int));
+  MVPDP **bin = (MVPDP**)malloc(nbpoints * sizeof(MVPDP*));
+  if(!assign || !bin) {
+    free(assign);
+    free(bin);
+    return MVP_MEMALLOC;
+  }
+
+  MVPError err = MVP_SUCCESS;
+  pthread_rwlock_wrlock(&shards->lock);
+  for(i = 0; i < nbpoints; i++) {
+    assign[i] = shard_of(shards, points[i]);
+  }
+  for(s = 0; s < shards->nbshards; s++) {
+    unsigned int count = 0;
+    for(i = 0; i < nbpoints; i++) {
+      if(assign[i] == s) bin[count++] = points[i];
+    }
+    if(count == 0) continue;
+
+    MVPShard *shard = &shards->shards[s];
+    MVPError e = MVP_SUCCESS;
+    if(shard->retrieve) {
+      e = MVP_ARGERR;
+    } else {
+      if(!shard->tree) {
+        shard->tree = mvptree_alloc(NULL, shards->dist, shards->branchfactor, shards->pathlength, \
+          shards->leafcap);
+      }
+      e = (shard->tree) ? mvptree_add(shard->tree, bin, count) : MVP_MEMALLOC;
+    }
+    if(err == MVP_SUCCESS) err = e;
+  }
+  pthread_rwlock_unlock(&shards->lock);
+
+  free(assign);
+  free(bin);
+  return err;
+}
+
+MVPError mvpshards_load(MVPShards *shards, unsigned int shard, const char *filename) {
+  if(!shards || shard >= shards->nbshards || !filename) return MVP_ARGERR;
+
+  /* read outside the lock, queries go on meanwhile */
+  MVPError err = MVP_SUCCESS;
+  MVPTree *tree = mvptree_read(filename, shards->dist, shards->branchfactor, shards->pathlength, \
+    shards->leafcap, &err);
+  if(err != MVP_SUCCESS) {
+    if(tree) {
+      mvptree_clear(tree, free);
+      free(tree);
+    }
+    return err;
+  }
+
+  pthread_rwlock_wrlock(&shards->lock);
+  MVPShard *slot = &shards->shards[shard];
+  if(slot->tree || slot->retrieve) {
+    err = MVP_ARGERR;
+  } else {
+    slot->tree = tree;
+  }
+  pthread_rwlock_unlock(&shards->lock);
+
+  if(err != MVP_SUCCESS) {
+    mvptree_clear(tree, free);
+    free(tree);
+  }
+  return err;
+}
+
+MVPError mvpshards_attach(MVPShards *shards, unsigned int shard, MVPShardRetrieveFunc retrieve, \
+  MVPShardCloseFunc close, void *ctx) {
+  if(!shards || shard >= shards->nbshards || !retrieve) return MVP_ARGERR;
+
+  MVPError err = MVP_SUCCESS;
+  pthread_rwlock_wrlock(&shards->lock);
+  MVPShard *slot = &shards->shards[shard];
+  if(slot->tree || slot->retrieve) {
+    err = MVP_ARGERR;
+  } else {
+    slot->retrieve = retrieve;
+    slot->close = close;
+    slot->ctx = ctx;
+  }
+  pthread_rwlock_unlock(&shards->lock);
+  return err;
+}
+
+MVPError mvpshards_save(MVPShards *shards, unsigned int shard, const char *filename, int mode) {
+  if(!shards || shard >= shards->nbshards || !filename) return MVP_ARGERR;
+
+  MVPError err;
+  /* mvptree_write() uses the tree's file state, so keep queries and changes out */
+  pthread_rwlock_wrlock(&shards->lock);
+  MVPShard *slot = &shards->shards[shard];
+  err = (slot->tree) ? mvptree_write(slot->tree, filename, mode) : MVP_ARGERR;
+  pthread_rwlock_unlock(&shards->lock);
+  return err;
+}
+
+MVPError mvpshards_unload(MVPShards *shards, unsigned int shard, MVPFreeFunc free_func) {
+  if(!shards || shard >= shards->nbshards) return MVP_ARGERR;
+
+  pthread_rwlock_wrlock(&shards->lock);
+  unload_shard(&shards->shards[shard], free_func);
+  pthread_rwlock_unlock(&shards->lock);
+  return MVP_SUCCESS;
+}
+
+/* merged result, with its distance from the target */
+typedef struct mvp_shard_result_t {
+  MVPDP *dp;
+  float d;
+  unsigned int order;             /* position in the shard order, to break ties */
+} MVPShardResult;
+
+static int cmp_result(const void *a, const void *b) {
+  const MVPShardResult *ra = (const MVPShardResult*)a;
+  const MVPShardResult *rb = (const MVPShardResult*)b;
+  if(ra->d < rb->d) return -1;
+  if(ra->d > rb->d) return 1;
+  return (ra->order < rb->order) ? -1 : (ra->order > rb->order);
+}
+
+MVPDP** mvpshards_retrieve(MVPShards *shards, MVPDP *target, unsigned int knearest, float radius, \
+  unsigned int *nbresults, MVPError *error) {
+  if(!error) return NULL;
+  if(!shards || !target || !nbresults || knearest == 0 || radius < 0) {
+    *error = MVP_ARGERR;
+    return NULL;
+  }
+  *nbresults = 0;
+  *error = MVP_SUCCESS;
+
+  unsigned int i, j, n = shards->nbshards;
+  MVPShardTask *tasks = (MVPShardTask*)malloc(n * sizeof(MVPShardTask));
+  if(!tasks) {
+    *error = MVP_MEMALLOC;
+    return NULL;
+  }
+
+  MVPShardQuery query;
+  query.target = target;
+  query.knearest = knearest;
+  query.radius = radius;
+  query.pending = n;
+  pthread_mutex_init(&query.lock, NULL);
+  pthread_cond_init(&query.done, NULL);
+  for(i = 0; i < n; i++) {
+    tasks[i].query = &query;
+    tasks[i].shard = i;
+    tasks[i].next = (i + 1 < n) ? &tasks[i + 1] : NULL;
+  }
+
+  /* the shards can not be unloaded until their results are merged */
+  pthread_rwlock_rdlock(&shards->lock);
+
+  if(shards->nbthreads > 0) {
+    pthread_mutex_lock(&shards->queue_lock);
+    if(shards->tail) shards->tail->next = &tasks[0];
+    else shards->head = &tasks[0];
+    shards->tail = &tasks[n - 1];
+    pthread_cond_broadcast(&shards->queue_cond);
+    pthread_mutex_unlock(&shards->queue_lock);
+
+    pthread_mutex_lock(&query.lock);
+    while(query.pending > 0) {
+      pthread_cond_wait(&query.done, &query.lock);
+    }
+    pthread_mutex_unlock(&query.lock);
+  } else {
+    for(i = 0; i < n; i++) {
+      run_task(shards, &tasks[i]);
+    }
+  }
+
+  /* merge into the global top knearest */
+  unsigned int total = 0;
+  int found = 0;
+  for(i = 0; i < n; i++) {
+    switch(tasks[i].error) {
+    case MVP_SUCCESS:
+    case MVP_KNEARESTCAP:
+      found = 1;
+      break;
+    case MVP_EMPTYTREE:
+      break;
+    default:
+      if(*error == MVP_SUCCESS) *error = tasks[i].error;
+    }
+    total += tasks[i].nbresults;
+  }
+
+  MVPDP **results = NULL;
+  MVPShardResult *merged = (MVPShardResult*)malloc((total + 1) * sizeof(MVPShardResult));
+  if(merged) {
+    unsigned int count = 0;
+    for(i = 0; i < n; i++) {
+      for(j = 0; j < tasks[i].nbresults; j++) {
+        merged[count].dp = tasks[i].results[j];
+        merged[count].d = tasks[i].dists[j];
+        merged[count].order = count;
+        count++;
+      }
+    }
+    qsort(merged, count, sizeof(MVPShardResult), cmp_result);
+    if(count > knearest) count = knearest;
+
+    results = (MVPDP**)malloc(knearest * sizeof(MVPDP*));
+    if(results) {
+      for(i = 0; i < count; i++) {
+        results[i] = merged[i].dp;
+      }
+      *nbresults = count;
+      if(count >= knearest && *error == MVP_SUCCESS) *error = MVP_KNEARESTCAP;
+    }
+    free(merged);
+  }
+  if(!results) {
+    *error = MVP_MEMALLOC;
+  } else if(!found && *error == MVP_SUCCESS) {
+    *error = MVP_EMPTYTREE;
+  }
+
+  pthread_rwlock_unlock(&shards->lock);
+
+  for(i = 0; i < n; i++) {
+    free(tasks[i].results);
+    free(tasks[i].dists);
+  }
+  free(tasks);
+  pthread_mutex_destroy(&query.lock);
+  pthread_cond_destroy(&query.done);
+  return results;
+}
+
+/* local stand-in for a remote shard */
+
+typedef struct mvp_shard_stub_t {
+  MVPTree *tree;
+} MVPShardStub;
+
+void* mvpshard_stub_open(const char *filename, CmpFunc distance, unsigned int bf, unsigned int p, \
+  unsigned int k, MVPError *error) {
+  if(!error) return NULL;
+  MVPShardStub *stub = (MVPShardStub*)malloc(sizeof(MVPShardStub));
+  if(!stub) {
+    *error = MVP_MEMALLOC;
+    return NULL;
+  }
+  stub->tree = mvptree_read(filename, distance, bf, p, k, error);
+  if(*error != MVP_SUCCESS) {
+    mvpshard_stub_close(stub);
+    return NULL;
+  }
+  return stub;
+}
+
+MVPDP** mvpshard_stub_retrieve(void *ctx, MVPDP *target, unsigned int knearest, float radius, \
+  unsigned int *nbresults, MVPError *error) {
+  MVPShardStub *stub = (MVPShardStub*)ctx;
+  if(!stub) {
+    *error = MVP_ARGERR;
+    return NULL;
+  }
+  return mvptree_retrieve(stub->tree, target, knearest, radius, nbresults, error);
+}
+
+void mvpshard_stub_close(void *ctx) {
+  MVPShardStub *stub = (MVPShardStub*)ctx;
+  if(stub) {
+    if(stub->tree) {
+      mvptree_clear(stub->tree, free);
+      free(stub->tree);
+    }
+    free(stub);
+  }
+}
@@ -0,0 +1,254 @@
+/*
+
+    MVPTree c library
+    Copyright (C) 2008-2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+#ifndef _MVPSHARD_H
+#define _MVPSHARD_H
+
+#include "mvptree.h"
+
+/* how mvpshards_add() assigns datapoints to shards */
+typedef enum mvp_partition_t {
+    MVP_PARTITION_PREFIX = 0,   /* by the leading bits of the datapoint's data */
+    MVP_PARTITION_ROUNDROBIN    /* in turn, for an even spread of the shards */
+} MVPPartition;
+
+/* call back function to query a remote shard - same contract as mvptree_retrieve(), */
+/* except that the returned datapoints must stay valid until the shard is unloaded   */
+typedef MVPDP** (*MVPShardRetrieveFunc)(void *ctx, MVPDP *target, unsigned int knearest, \
+                                        float radius, unsigned int *nbresults, MVPError *error);
+
+/* call back function to release a remote shard when it is unloaded */
+typedef void (*MVPShardCloseFunc)(void *ctx);
+
+/* collection of MVPTree shards, queried in parallel (opaque) */
+typedef struct mvp_shards_t MVPShards;
+
+/*  mvpshards_alloc
+ *
+ *  DESCRIPTION:
+ *
+ *  allocate a collection of nbshards shard slots, all empty. The trees created for
+ *  the local shards use distance, bf, p and k as in mvptree_alloc().
+ *
+ *  ARGUMENTS:
+ *
+ *  nbshards - number of shard slots
+ *
+ *  partition - how mvpshards_add() spreads the datapoints over the shards
+ *
+ *  nbthreads - number of threads in the pool that queries the shards; 0 to query
+ *              them one after another in the calling thread
+ *
+ *  distance, bf, p, k - see mvptree_alloc()
+ *
+ *  RETURN:
+ *
+ *  ptr to the MVPShards, NULL on error
+ */
+
+MVPShards* mvpshards_alloc(unsigned int nbshards, MVPPartition partition, unsigned int nbthreads, \
+                           CmpFunc distance, unsigned int bf, unsigned int p, unsigned int k);
+
+/*  mvpshards_free
+ *
+ *  DESCRIPTION:
+ *
+ *  stop the thread pool, unload all shards and free the collection
+ *
+ *  ARGUMENTS:
+ *
+ *  shards - ptr to the MVPShards
+ *
+ *  free_func - see mvptree_clear()
+ *
+ *  RETURN:
+ *
+ *  void
+ */
+
+void mvpshards_free(MVPShards *shards, MVPFreeFunc free_func);
+
+/*  mvpshards_add
+ *
+ *  DESCRIPTION:
+ *
+ *  add datapoints to the collection, each to the local shard chosen by the partition
+ *  scheme. An empty slot gets a new tree. Points for a slot held by a remote shard are
+ *  not added.
+ *
+ *  ARGUMENTS:
+ *
+ *  shards - ptr to the MVPShards
+ *
+ *  points - array of datapoint ptrs, owned by the shards after the call (see mvptree_add())
+ *
+ *  nbpoints - number of datapoints
+ *
+ *  RETURN:
+ *
+ *  MVPError code - MVP_ARGERR if some points belong to a remote shard
+ */
+
+MVPError mvpshards_add(MVPShards *shards, MVPDP **points, unsigned int nbpoints);
+
+/*  mvpshards_load
+ *
+ *  DESCRIPTION:
+ *
+ *  load a shard from a file written by mvpshards_save() or mvptree_write(), into an
+ *  empty slot. Can be called while other threads query the collection.
+ *
+ *  ARGUMENTS:
+ *
+ *  shards - ptr to the MVPShards
+ *
+ *  shard - slot index
+ *
+ *  filename - file to read
+ *
+ *  RETURN:
+ *
+ *  MVPError code
+ */
+
+MVPError mvpshards_load(MVPShards *shards, unsigned int shard, const char *filename);
+
+/*  mvpshards_attach
+ *
+ *  DESCRIPTION:
+ *
+ *  put a remote shard in an empty slot. The collection queries it through retrieve,
+ *  and calls close with ctx when the shard is unloaded.
+ *
+ *  ARGUMENTS:
+ *
+ *  shards - ptr to the MVPShards
+ *
+ *  shard - slot index
+ *
+ *  retrieve, close, ctx - call backs for the remote shard, and their context
+ *
+ *  RETURN:
+ *
+ *  MVPError code
+ */
+
+MVPError mvpshards_attach(MVPShards *shards, unsigned int shard, MVPShardRetrieveFunc retrieve, \
+                          MVPShardCloseFunc close, void *ctx);
+
+/*  mvpshards_save
+ *
+ *  DESCRIPTION:
+ *
+ *  write a local shard to a file (see mvptree_write())
+ *
+ *  ARGUMENTS:
+ *
+ *  shards - ptr to the MVPShards
+ *
+ *  shard - slot index
+ *
+ *  filename - file to write
+ *
+ *  mode - mode for file open
+ *
+ *  RETURN:
+ *
+ *  MVPError code
+ */
+
+MVPError mvpshards_save(MVPShards *shards, unsigned int shard, const char *filename, int mode);
+
+/*  mvpshards_unload
+ *
+ *  DESCRIPTION:
+ *
+ *  empty a slot, freeing a local shard's tree or closing a remote shard. Waits for the
+ *  queries in progress. Results returned earlier from this shard are no longer valid.
+ *
+ *  ARGUMENTS:
+ *
+ *  shards - ptr to the MVPShards
+ *
+ *  shard - slot index
+ *
+ *  free_func - see mvptree_clear()
+ *
+ *  RETURN:
+ *
+ *  MVPError code
+ */
+
+MVPError mvpshards_unload(MVPShards *shards, unsigned int shard, MVPFreeFunc free_func);
+
+/*  mvpshards_retrieve
+ *
+ *  DESCRIPTION:
+ *
+ *  query all loaded shards in parallel and merge their results into the knearest
+ *  closest datapoints within radius of the target, closest first.
+ *
+ *  Each shard returns at most knearest points, and like mvptree_retrieve() these are
+ *  the first ones found within radius, not necessarily the closest ones. The merged
+ *  list is exact whenever no shard reaches knearest.
+ *
+ *  ARGUMENTS:
+ *
+ *  shards - ptr to the MVPShards
+ *
+ *  target, knearest, radius, nbresults, error - see mvptree_retrieve(). error is the
+ *  first error reported by a shard, or MVP_KNEARESTCAP if the list holds knearest points.
+ *
+ *  RETURN:
+ *
+ *  MVPDP** array of ptrs to datapoints. The user must free the array, but not the
+ *  datapoints, which stay owned by their shards.
+ */
+
+MVPDP** mvpshards_retrieve(MVPShards *shards, MVPDP *target, unsigned int knearest, float radius, \
+                           unsigned int *nbresults, MVPError *error);
+
+/*  mvpshard_stub_open, mvpshard_stub_retrieve, mvpshard_stub_close
+ *
+ *  DESCRIPTION:
+ *
+ *  local stand-in for a remote shard: serves a tree file through the remote shard call
+ *  backs, to test remote deployments in a single process. E.g.
+ *
+ *    void *ctx = mvpshard_stub_open("shard3.mvp", distance, 2, 5, 25, &err);
+ *    mvpshards_attach(shards, 3, mvpshard_stub_retrieve, mvpshard_stub_close, ctx);
+ *
+ *  RETURN:
+ *
+ *  mvpshard_stub_open returns the ctx for mvpshards_attach(), NULL on error
+ */
+
+void* mvpshard_stub_open(const char *filename, CmpFunc distance, unsigned int bf, unsigned int p, \
+                         unsigned int k, MVPError *error);
+
+MVPDP** mvpshard_stub_retrieve(void *ctx, MVPDP *target, unsigned int knearest, float radius, \
+                               unsigned int *nbresults, MVPError *error);
+
+void mvpshard_stub_close(void *ctx);
+
+#endif /* _MVPSHARD_H */
@@ -65,9 +65,11 @@ const char *error_msgs[] = {
     "datatypes in conflict",
     "no. retrieved exceeds k",
     "empty tree",
+    "unable to calculate split points",
     "distance value either NaN or less than zero",
     "could not open file",
-    "unrecognized node" };
+    "unrecognized node",
+    "id not found" };
 
 
 const char* mvp_errstr(MVPError err){
@@ -81,6 +83,7 @@ MVPDP* dp_alloc(MVPDataType type){
     newdp->datalen = 0;
     newdp->type = type;
     newdp->path = NULL;
+    newdp->deleted = 0;
     return newdp;
 }
 
@@ -113,6 +116,7 @@ MVPTree* mvptree_alloc(MVPTree *tree, CmpFunc distance, unsigned int bf, unsigne
   retTree->pathlength = p;
   retTree->leafcap = k;
   retTree->dist = distance;
+  retTree->batchdist = NULL;
   retTree->datatype = 0;
   retTree->node = NULL;
   retTree->fd = 0;
@@ -131,6 +135,101 @@ static int is_nan(float x){
     return (var != var) ? 1 : 0;
 }
 
+/* built-in distance metrics */
+
+static inline unsigned int popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (unsigned int)__builtin_popcountll(x);
+#else
+  const uint64_t m1 = 0x5555555555555555ULL;
+  const uint64_t m2 = 0x3333333333333333ULL;
+  const uint64_t h01 = 0x0101010101010101ULL;
+  const uint64_t m4 = 0x0f0f0f0f0f0f0f0fULL;
+  x -= (x >> 1) & m1;
+  x = (x & m2) + ((x >> 2) & m2);
+  x = (x + (x >> 4)) & m4;
+  return (unsigned int)((x * h01) >> 56);
+#endif
+}
+
+static inline float hamming64_kernel(const uint64_t *a, const uint64_t *b, unsigned int len) {
+  unsigned int i, d = 0;
+  for(i = 0; i < len; i++) {
+    d += popcount64(a[i] ^ b[i]);
+  }
+  return (float)d;
+}
+
+static inline float hamming8_kernel(const uint8_t *a, const uint8_t *b, unsigned int len) {
+  unsigned int i = 0, d = 0;
+  uint64_t x, y;
+  for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    memcpy(&x, a + i, sizeof(uint64_t));
+    memcpy(&y, b + i, sizeof(uint64_t));
+    d += popcount64(x ^ y);
+  }
+  for(; i < len; i++) {
+    d += popcount64((uint64_t)(a[i] ^ b[i]));
+  }
+  return (float)d / (float)(8 * len);
+}
+
+/* same calculation as ph_crosscorr(), the denominators do not depend on the shift */
+static inline float crosscorr_kernel(const uint8_t *x, const uint8_t *y, unsigned int N) {
+  double sumx = 0.0, sumy = 0.0, denx = 0.0, deny = 0.0, max = 0.0;
+  unsigned int i, d;
+  for(i = 0; i < N; i++) {
+    sumx += x[i];
+    sumy += y[i];
+  }
+  double meanx = sumx / N;
+  double meany = sumy / N;
+  for(i = 0; i < N; i++) {
+    denx += (x[i] - meanx)*(x[i] - meanx);
+    deny += (y[i] - meany)*(y[i] - meany);
+  }
+  double den = sqrt(denx*deny);
+  for(d = 0; d < N; d++) {
+    double num = 0.0;
+    for(i = 0; i < d; i++) {
+      num += (x[i] - meanx)*(y[N + i - d] - meany);
+    }
+    for(; i < N; i++) {
+      num += (x[i] - meanx)*(y[i - d] - meany);
+    }
+    double r = num / den;
+    if(r > max) max = r;
+  }
+  return (float)(1.0 - max);
+}
+
+static inline int same_shape(MVPDP *pointA, MVPDP *pointB, MVPDataType type) {
+  return pointA && pointB && pointA->type == type && pointB->type == type && \
+    pointA->datalen == pointB->datalen && pointA->datalen > 0;
+}
+
+float mvp_hamming64_distance(MVPDP *pointA, MVPDP *pointB) {
+  if(!same_shape(pointA, pointB, MVP_UINT64ARRAY)) return -1.0f;
+  return hamming64_kernel((uint64_t*)pointA->data, (uint64_t*)pointB->data, pointA->datalen);
+}
+
+float mvp_hamming8_distance(MVPDP *pointA, MVPDP *pointB) {
+  if(!same_shape(pointA, pointB, MVP_BYTEARRAY)) return -1.0f;
+  return hamming8_kernel((uint8_t*)pointA->data, (uint8_t*)pointB->data, pointA->datalen);
+}
+
+float mvp_crosscorr_distance(MVPDP *pointA, MVPDP *pointB) {
+  if(!same_shape(pointA, pointB, MVP_BYTEARRAY)) return -1.0f;
+  return crosscorr_kernel((uint8_t*)pointA->data, (uint8_t*)pointB->data, pointA->datalen);
+}
+
+static MVPMetric tree_metric(MVPTree *tree) {
+  if(tree->dist == mvp_hamming64_distance) return MVP_HAMMING64;
+  if(tree->dist == mvp_hamming8_distance) return MVP_HAMMING8;
+  if(tree->dist == mvp_crosscorr_distance) return MVP_CROSSCORR;
+  return MVP_CUSTOM;
+}
+
 static Node* create_leaf(unsigned int leafcap){
     Node *node = (Node*)malloc(sizeof(Node));
     node->leaf.sv1 = NULL;
@@ -139,6 +238,8 @@ static Node* create_leaf(unsigned int leafcap){
     node->leaf.d1 = (float*)calloc(leafcap,sizeof(float));
     node->leaf.d2 = (float*)calloc(leafcap,sizeof(float));
     node->leaf.nbpoints = 0;
+    node->leaf.packed = NULL;
+    node->leaf.packedlen = 0;
     node->leaf.type = LEAF_NODE;
 
     return node;
@@ -163,6 +264,7 @@ static void free_node(Node *node) {
       free(node->leaf.points);
       free(node->leaf.d1);
       free(node->leaf.d2);
+      free(node->leaf.packed);
     } else if(node->internal.type == INTERNAL_NODE) {
       free(node->internal.M1);
       free(node->internal.M2);
@@ -172,6 +274,32 @@ static void free_node(Node *node) {
   }
 }
 
+/* copy the data of a leaf's points into one array for the hamming metrics, so the */
+/* leaf can be scanned without chasing each point's data pointer                   */
+static void pack_leaf(MVPTree *tree, Node *node) {
+  free(node->leaf.packed);
+  node->leaf.packed = NULL;
+  node->leaf.packedlen = 0;
+  if(tree_metric(tree) == MVP_CUSTOM || tree_metric(tree) == MVP_CROSSCORR || \
+    node->leaf.nbpoints == 0) return;
+
+  unsigned int i, len = node->leaf.points[0]->datalen;
+  for(i = 0; i < node->leaf.nbpoints; i++) {
+    if(node->leaf.points[i]->datalen != len || node->leaf.points[i]->type != tree->datatype) {
+      return;
+    }
+  }
+
+  size_t size = (size_t)len * tree->datatype;
+  char *packed = (char*)malloc(node->leaf.nbpoints * size);
+  if(!packed) return;
+  for(i = 0; i < node->leaf.nbpoints; i++) {
+    memcpy(packed + i*size, node->leaf.points[i]->data, size);
+  }
+  node->leaf.packed = packed;
+  node->leaf.packedlen = len;
+}
+
 static void _mvptree_clear(MVPTree *tree, Node *node, MVPFreeFunc free_func, int lvl) {
   if(!node) 	return;
   if(node->internal.type == INTERNAL_NODE) {
@@ -400,6 +528,7 @@ static Node* _mvptree_add(MVPTree *tree, Node *node, MVPDP **points, unsigned in
         new_node->leaf.points[count++] = points[i];
       }
       new_node->leaf.nbpoints = count;
+      pack_leaf(tree, new_node);
 
     } else { /* create internal node */
       new_node = create_internal(tree->branchfactor);
@@ -513,6 +642,7 @@ static Node* _mvptree_add(MVPTree *tree, Node *node, MVPDP **points, unsigned in
           new_node->leaf.points[count++] = points[pos];
         }
         new_node->leaf.nbpoints = count;
+        pack_leaf(tree, new_node);
       } else {
 
         /* not enough room in current leaf - create new node */
@@ -620,6 +750,7 @@ MVPError mvptree_add(MVPTree *tree, MVPDP **points, unsigned int nbpoints) {
         return MVP_PATHALLOC;
       }
       memset(points[i]->path, 0, tree->pathlength * sizeof(float));
+      points[i]->deleted = 0;
     }
     tree->node = _mvptree_add(tree, tree->node, points, nbpoints, &err, 0);
   } else {
@@ -629,156 +760,302 @@ MVPError mvptree_add(MVPTree *tree, MVPDP **points, unsigned int nbpoints) {
 }
 
 
-static 
-MVPError _mvptree_retrieve(MVPTree *tree, Node *node, MVPDP *target, float radius, MVPDP** results, \
-  unsigned int *nbresults, int lvl) {
-  MVPError err = MVP_SUCCESS;
-  int bf = tree->branchfactor;
-  int lengthM1 = bf - 1;
-  float d1, d2;
-  if(node == NULL) return err;
-
-  CmpFunc distance = tree->dist;
-  unsigned int i, j;
+static unsigned int tombstone(MVPDP *dp, const char *id) {
+  if(dp && !dp->deleted && dp->id && !strcmp(dp->id, id)) {
+    dp->deleted = 1;
+    return 1;
+  }
+  return 0;
+}
 
+static unsigned int _mvptree_delete(MVPTree *tree, Node *node, const char *id) {
+  unsigned int i, count = 0;
+  if(!node) return 0;
   if(node->leaf.type == LEAF_NODE) {
-    d1 = distance(target, node->leaf.sv1);
-    if(is_nan(d1) || d1 < 0.0f) {
-      return MVP_BADDISTVAL;
+    count += tombstone(node->leaf.sv1, id);
+    count += tombstone(node->leaf.sv2, id);
+    for(i = 0; i < node->leaf.nbpoints; i++) {
+      count += tombstone(node->leaf.points[i], id);
     }
-
-    if(lvl < tree->pathlength) target->path[lvl] = d1;
-    if(d1 <= radius) {
-      results[(*nbresults)++] = node->leaf.sv1;
-      if(*nbresults >= tree->k) return MVP_KNEARESTCAP;
+  } else if(node->internal.type == INTERNAL_NODE) {
+    count += tombstone(node->internal.sv1, id);
+    count += tombstone(node->internal.sv2, id);
+    unsigned int fanout = tree->branchfactor*tree->branchfactor;
+    for(i = 0; i < fanout; i++) {
+      count += _mvptree_delete(tree, node->internal.child_nodes[i], id);
     }
-    if(tree->node->leaf.sv2) {
-      d2 = distance(target, node->leaf.sv2);
+  }
+  return count;
+}
 
-      if(is_nan(d2) || d2 < 0.0f) {
-        return MVP_BADDISTVAL;
-      }
-      if(d2 <= radius) {
-        results[(*nbresults)++] = node->leaf.sv2;
-        if(*nbresults >= tree->k) return MVP_KNEARESTCAP;
-      }
-      if(lvl + 1 < tree->pathlength) target->path[lvl + 1] = d2;
-      for(i = 0; i < node->leaf.nbpoints; i++) {
-
-        /* check all points
-        float d = distance(target,node->leaf.points[i]);
-        fprintf(stdout,"pnt%d distance(Q,%s)=%f\n",i,node->leaf.points[i]->id,d);
-        if (d <= radius){
-            results[(*nbresults)++] = node->leaf.points[i];
-            if (*nbresults >= tree->k){
-          return MVP_KNEARESTCAP;
-            }
-        }
-        */
-
-        /* filter points before checking */
-        if(d1 - radius <= node->leaf.d1[i] && d1 + radius >= node->leaf.d1[i]) {
-          if(d2 - radius <= node->leaf.d2[i] && d2 + radius >= node->leaf.d2[i]) {
-            int endpath = (lvl + 1 < tree->pathlength) ? lvl + 1 : tree->pathlength;
-            int skip = 0;
-            for(j = 0; j < endpath; j++) {
-              if(target->path[j] - radius <= node->leaf.points[i]->path[j] && \
-                target->path[j] + radius >= node->leaf.points[i]->path[j]) {
-                continue;
-              } else {
-                skip = 1;
-                break;
-              }
-            }
-            if(!skip) {
-
-              float d = distance(target, node->leaf.points[i]);
-              if(is_nan(d) || d < 0.0) {
-                return MVP_BADDISTVAL;
-              }
-              if(d <= radius) {
-                results[(*nbresults)++] = node->leaf.points[i];
-                if(*nbresults >= tree->k) {
-                  return MVP_KNEARESTCAP;
-                }
-              }
-            }
-          }
-        }
+MVPError mvptree_delete(MVPTree *tree, const char *id) {
+  if(!tree || !id) return MVP_ARGERR;
+  if(!tree->node) return MVP_EMPTYTREE;
+  return (_mvptree_delete(tree, tree->node, id) > 0) ? MVP_SUCCESS : MVP_IDNOTFOUND;
+}
 
-      }
+/* apply fnc to each datapoint of a subtree */
+static void foreach_point(MVPTree *tree, Node *node, void (*fnc)(MVPDP*, void*), void *arg) {
+  unsigned int i;
+  if(!node) return;
+  if(node->leaf.type == LEAF_NODE) {
+    if(node->leaf.sv1) fnc(node->leaf.sv1, arg);
+    if(node->leaf.sv2) fnc(node->leaf.sv2, arg);
+    for(i = 0; i < node->leaf.nbpoints; i++) {
+      fnc(node->leaf.points[i], arg);
     }
   } else if(node->internal.type == INTERNAL_NODE) {
-    d1 = distance(target, node->internal.sv1);
-    if(is_nan(d1) || d1 < 0.0f) {
-      return MVP_BADDISTVAL;
+    fnc(node->internal.sv1, arg);
+    fnc(node->internal.sv2, arg);
+    unsigned int fanout = tree->branchfactor*tree->branchfactor;
+    for(i = 0; i < fanout; i++) {
+      foreach_point(tree, node->internal.child_nodes[i], fnc, arg);
     }
-    if(d1 <= radius) {
-      results[(*nbresults)++] = node->internal.sv1;
-      if(*nbresults >= tree->k) return MVP_KNEARESTCAP;
+  }
+}
+
+/* free the nodes of a subtree, but not its datapoints */
+static void free_nodes(MVPTree *tree, Node *node) {
+  if(!node) return;
+  if(node->internal.type == INTERNAL_NODE) {
+    unsigned int i, fanout = tree->branchfactor*tree->branchfactor;
+    for(i = 0; i < fanout; i++) {
+      free_nodes(tree, node->internal.child_nodes[i]);
     }
-    if(lvl < tree->pathlength) target->path[lvl] = d1;
-    d2 = distance(target, node->internal.sv2);
-    if(is_nan(d2) || d2 < 0.0f) {
-      return MVP_BADDISTVAL;
+  }
+  free_node(node);
+}
+
+typedef struct mvp_compact_t {
+  MVPDP **live;          /* remaining datapoints of the subtree */
+  MVPDP **dead;          /* tombstoned datapoints of the subtree */
+  unsigned int nblive, nbdead;
+} MVPCompact;
+
+static void count_point(MVPDP *dp, void *arg) {
+  MVPCompact *c = (MVPCompact*)arg;
+  if(dp->deleted) c->nbdead++;
+  else c->nblive++;
+}
+
+static void collect_point(MVPDP *dp, void *arg) {
+  MVPCompact *c = (MVPCompact*)arg;
+  if(dp->deleted) c->dead[c->nbdead++] = dp;
+  else c->live[c->nblive++] = dp;
+}
+
+/* rebuild node from its live datapoints, returns the new subtree */
+static Node* rebuild_subtree(MVPTree *tree, Node *node, MVPCompact *c, MVPFreeFunc free_func, \
+  MVPError *error, int lvl) {
+  unsigned int i, nb = c->nblive + c->nbdead;
+  int pathlength = (lvl < tree->pathlength) ? tree->pathlength - lvl : 0;
+
+  c->live = (MVPDP**)malloc(nb * sizeof(MVPDP*));
+  c->dead = c->live + c->nblive;
+  /* the rebuild overwrites the paths from lvl down, save them in case it fails */
+  float *paths = (float*)malloc((c->nblive * pathlength + 1) * sizeof(float));
+  if(!c->live || !paths) {
+    free(c->live);
+    free(paths);
+    *error = MVP_MEMALLOC;
+    return node;
+  }
+  c->nblive = c->nbdead = 0;
+  foreach_point(tree, node, collect_point, c);
+  for(i = 0; i < c->nblive; i++) {
+    memcpy(paths + i*pathlength, c->live[i]->path + lvl, pathlength * sizeof(float));
+  }
+
+  MVPError err = MVP_SUCCESS;
+  Node *new_node = _mvptree_add(tree, NULL, c->live, c->nblive, &err, lvl);
+  if(err == MVP_SUCCESS) {
+    free_nodes(tree, node);
+    for(i = 0; i < c->nbdead; i++) {
+      dp_free(c->dead[i], free_func);
     }
-    if(d2 <= radius) {
-      results[(*nbresults)++] = node->internal.sv2;
-      if(*nbresults >= tree->k) return MVP_KNEARESTCAP;
+  } else {
+    free_nodes(tree, new_node);
+    for(i = 0; i < c->nblive; i++) {
+      memcpy(c->live[i]->path + lvl, paths + i*pathlength, pathlength * sizeof(float));
     }
-    if(lvl + 1 < tree->pathlength) target->path[lvl + 1] = d2;
-    /* check <= each 1st level bins */
-    for(i = 0; i < lengthM1; i++) {
-
-      if(d1 - radius <= node->internal.M1[i]) {
+    *error = err;
+    new_node = node;
+  }
+  free(c->live);
+  free(paths);
+  return new_node;
+}
 
-        /* check <= each 2nd level bins */
-        for(j = 0; j < lengthM1; j++) {
-          if(d2 - radius <= node->internal.M2[i*lengthM1 + j]) {
+static Node* _mvptree_compact(MVPTree *tree, Node *node, float ratio, MVPFreeFunc free_func, \
+  MVPError *error, int lvl) {
+  if(!node || *error != MVP_SUCCESS) return node;
 
-            err = _mvptree_retrieve(tree, node->internal.child_nodes[i*bf + j], target, \
-              radius, results, nbresults, lvl + 2);
+  MVPCompact c = { NULL, NULL, 0, 0 };
+  foreach_point(tree, node, count_point, &c);
+  if(c.nbdead == 0) return node;
 
-            if(err != MVP_SUCCESS) return err;
-          }
-        }
-        /* check >= last 2nd level bin  */
-        if(d2 + radius >= node->internal.M2[i*lengthM1 + lengthM1 - 1]) {
+  if(c.nbdead > ratio*(c.nblive + c.nbdead)) {
+    return rebuild_subtree(tree, node, &c, free_func, error, lvl);
+  }
 
-          err = _mvptree_retrieve(tree, node->internal.child_nodes[i*bf + lengthM1], \
-            target, radius, results, nbresults, lvl + 2);
-          if(err != MVP_SUCCESS) return err;
-        }
-      }
+  /* below the threshold here, but a smaller subtree may still be above it */
+  if(node->internal.type == INTERNAL_NODE) {
+    unsigned int i, fanout = tree->branchfactor*tree->branchfactor;
+    for(i = 0; i < fanout; i++) {
+      node->internal.child_nodes[i] = _mvptree_compact(tree, node->internal.child_nodes[i], \
+        ratio, free_func, error, lvl + 2);
     }
+  }
+  return node;
+}
 
-    /* check >= last 1st level bin */
-    if(d1 + radius >= node->internal.M1[lengthM1 - 1]) {
+MVPError mvptree_compact(MVPTree *tree, float ratio, MVPFreeFunc free_func) {
+  MVPError err = MVP_SUCCESS;
+  if(!tree || is_nan(ratio) || ratio < 0.0f || ratio >= 1.0f) return MVP_ARGERR;
+  tree->node = _mvptree_compact(tree, tree->node, ratio, free_func, &err, 0);
+  return err;
+}
 
-      /* check <= each 2nd level bins */
-      for(j = 0; j < lengthM1; j++) {
-        if(d2 - radius <= node->internal.M2[lengthM1*lengthM1 + j]) {
+/* per target state for mvptree_retrieve_batch() */
+typedef struct mvp_batch_t {
+  MVPDP **targets;
+  MVPDP ***results;
+  unsigned int *nbresults;
+  MVPError *errors;
+  char **scratch;          /* scratch space of the nodes at each depth, shared by them */
+  unsigned int nbscratch;
+  size_t scratchsize;
+} MVPBatch;
+
+/* scratch space for the nodes at depth, allocated on first use. Nodes at the same */
+/* depth are visited one after the other, so they share it.                       */
+static char* get_batch_scratch(MVPBatch *batch, unsigned int depth) {
+  if(depth >= batch->nbscratch) {
+    unsigned int i;
+    char **scratch = (char**)realloc(batch->scratch, (depth + 1) * sizeof(char*));
+    if(!scratch) return NULL;
+    for(i = batch->nbscratch; i <= depth; i++) scratch[i] = NULL;
+    batch->scratch = scratch;
+    batch->nbscratch = depth + 1;
+  }
+  if(!batch->scratch[depth]) {
+    batch->scratch[depth] = (char*)malloc(batch->scratchsize);
+  }
+  return batch->scratch[depth];
+}
 
-          err = _mvptree_retrieve(tree, node->internal.child_nodes[bf*lengthM1 + j], \
-            target, radius, results, nbresults, lvl + 2);
-          if(err != MVP_SUCCESS) return err;
-        }
-      }
-      /* check >= last 2nd level bin  */
+/* add a result for target q, returns non-zero if q is finished */
+static int add_batch_result(MVPTree *tree, MVPBatch *batch, unsigned int q, MVPDP *dp) {
+  batch->results[q][batch->nbresults[q]++] = dp;
+  if(batch->nbresults[q] >= tree->k) {
+    batch->errors[q] = MVP_KNEARESTCAP;
+    return 1;
+  }
+  return 0;
+}
+
+/* leaf scans for the hamming metrics, over the packed data of the leaf */
 
-      if(d2 + radius >= node->internal.M2[lengthM1*lengthM1 + lengthM1 - 1]) {
+#define MVP_LEAF_BLOCK 64
 
-        err = _mvptree_retrieve(tree, node->internal.child_nodes[bf*lengthM1 + lengthM1], \
-          target, radius, results, nbresults, lvl + 2);
-        if(err != MVP_SUCCESS) return err;
+static inline void hamming64_leaf(MVPDP *target, Node *node, unsigned int start, unsigned int count, \
+  float *d) {
+  unsigned int i, len = node->leaf.packedlen;
+  const uint64_t *q = (const uint64_t*)target->data;
+  const uint64_t *p = (const uint64_t*)node->leaf.packed + (size_t)start*len;
+  if(len == 1) {
+    for(i = 0; i < count; i++) {
+      d[i] = (float)popcount64(q[0] ^ p[i]);
+    }
+  } else {
+    for(i = 0; i < count; i++) {
+      d[i] = hamming64_kernel(q, p + (size_t)i*len, len);
+    }
+  }
+}
+
+static inline void hamming8_leaf(MVPDP *target, Node *node, unsigned int start, unsigned int count, \
+  float *d) {
+  unsigned int i, len = node->leaf.packedlen;
+  const uint8_t *p = (const uint8_t*)node->leaf.packed + (size_t)start*len;
+  for(i = 0; i < count; i++) {
+    d[i] = hamming8_kernel((const uint8_t*)target->data, p + (size_t)i*len, len);
+  }
+}
+
+/* vantage point distances of a block of targets for the hamming metrics. The checks */
+/* on vp are made once for the block, and single word hashes are gathered           */
+/* MVP_LEAF_BLOCK at a time so they are scanned like the points of a packed leaf.   */
+
+static inline void hamming64_batch(MVPDP *vp, MVPDP **points, unsigned int nbpoints, float *d) {
+  unsigned int i, j;
+  if(!vp || vp->type != MVP_UINT64ARRAY || vp->datalen == 0) {
+    for(i = 0; i < nbpoints; i++) d[i] = -1.0f;
+    return;
+  }
+
+  unsigned int len = vp->datalen;
+  const uint64_t *q = (const uint64_t*)vp->data;
+  if(len == 1) {
+    uint64_t words[MVP_LEAF_BLOCK];
+    unsigned char valid[MVP_LEAF_BLOCK];
+    for(i = 0; i < nbpoints; i += MVP_LEAF_BLOCK) {
+      unsigned int count = (nbpoints - i < MVP_LEAF_BLOCK) ? nbpoints - i : MVP_LEAF_BLOCK;
+      for(j = 0; j < count; j++) {
+        valid[j] = (unsigned char)same_shape(vp, points[i + j], MVP_UINT64ARRAY);
+        words[j] = valid[j] ? *(const uint64_t*)points[i + j]->data : 0;
+      }
+      for(j = 0; j < count; j++) {
+        d[i + j] = valid[j] ? (float)popcount64(q[0] ^ words[j]) : -1.0f;
       }
     }
   } else {
-    err = MVP_UNRECOGNIZED;
+    for(i = 0; i < nbpoints; i++) {
+      d[i] = same_shape(vp, points[i], MVP_UINT64ARRAY) ? \
+        hamming64_kernel(q, (const uint64_t*)points[i]->data, len) : -1.0f;
+    }
+  }
+}
+
+static inline void hamming8_batch(MVPDP *vp, MVPDP **points, unsigned int nbpoints, float *d) {
+  unsigned int i;
+  if(!vp || vp->type != MVP_BYTEARRAY || vp->datalen == 0) {
+    for(i = 0; i < nbpoints; i++) d[i] = -1.0f;
+    return;
+  }
+
+  const uint8_t *q = (const uint8_t*)vp->data;
+  for(i = 0; i < nbpoints; i++) {
+    d[i] = same_shape(vp, points[i], MVP_BYTEARRAY) ? \
+      hamming8_kernel(q, (const uint8_t*)points[i]->data, vp->datalen) : -1.0f;
   }
-  return err;
 }
 
+/* instantiate the retrieval functions for the user's distance function */
+/* and for each of the built-in metrics                                 */
+
+#define MVP_NAME(fn) fn##_custom
+#define MVP_DISTANCE(tree, a, b) (tree)->dist((a), (b))
+#include "mvptree_retrieve.inc"
+
+#define MVP_NAME(fn) fn##_hamming64
+#define MVP_DISTANCE(tree, a, b) mvp_hamming64_distance((a), (b))
+#define MVP_LEAF_DISTANCES hamming64_leaf
+#define MVP_BATCH_DISTANCES hamming64_batch
+#include "mvptree_retrieve.inc"
+
+#define MVP_NAME(fn) fn##_hamming8
+#define MVP_DISTANCE(tree, a, b) mvp_hamming8_distance((a), (b))
+#define MVP_LEAF_DISTANCES hamming8_leaf
+#define MVP_BATCH_DISTANCES hamming8_batch
+#include "mvptree_retrieve.inc"
+
+#define MVP_NAME(fn) fn##_crosscorr
+/* no leaf block for crosscorr: its O(N^2) kernel is only worth running on the points */
+/* that pass the vantage point filters                                               */
+#define MVP_DISTANCE(tree, a, b) mvp_crosscorr_distance((a), (b))
+#include "mvptree_retrieve.inc"
+
 MVPDP** mvptree_retrieve(MVPTree *tree, MVPDP *target, unsigned int knearest, float radius, \
   unsigned int *nbresults, MVPError *error) {
   if(!tree || !target || !nbresults || knearest == 0 || radius < 0) {
@@ -813,7 +1090,19 @@ MVPDP** mvptree_retrieve(MVPTree *tree, MVPDP *target, unsigned int knearest, fl
   }
   tree->k = knearest;
 
-  *error = _mvptree_retrieve(tree, tree->node, target, radius, results, nbresults, 0);
+  switch(tree_metric(tree)) {
+  case MVP_HAMMING64:
+    *error = _mvptree_retrieve_hamming64(tree, tree->node, target, radius, results, nbresults, 0);
+    break;
+  case MVP_HAMMING8:
+    *error = _mvptree_retrieve_hamming8(tree, tree->node, target, radius, results, nbresults, 0);
+    break;
+  case MVP_CROSSCORR:
+    *error = _mvptree_retrieve_crosscorr(tree, tree->node, target, radius, results, nbresults, 0);
+    break;
+  default:
+    *error = _mvptree_retrieve_custom(tree, tree->node, target, radius, results, nbresults, 0);
+  }
 
   free(target->path);
   target->path = NULL;
@@ -821,6 +1110,92 @@ MVPDP** mvptree_retrieve(MVPTree *tree, MVPDP *target, unsigned int knearest, fl
   return results;
 }
 
+MVPDP*** mvptree_retrieve_batch(MVPTree *tree, MVPDP **targets, unsigned int nbtargets, \
+  unsigned int knearest, float radius, unsigned int *nbresults, MVPError *errors) {
+  MVPError err = MVP_SUCCESS;
+  unsigned int i, nballoc = 0;
+  if(!errors) return NULL;
+
+  if(!tree || !targets || nbtargets == 0 || !nbresults || knearest == 0 || radius < 0) {
+    err = MVP_ARGERR;
+  } else if(!tree->dist) {
+    err = MVP_NODISTANCEFUNC;
+  } else if(!tree->node) {
+    err = MVP_EMPTYTREE;
+  }
+
+  MVPDP ***results = NULL;
+  unsigned int *active = NULL;
+  if(err == MVP_SUCCESS) {
+    results = (MVPDP***)calloc(nbtargets, sizeof(MVPDP**));
+    active = (unsigned int*)malloc(nbtargets * sizeof(unsigned int));
+    if(!results || !active) err = MVP_MEMALLOC;
+  }
+
+  for(i = 0; i < nbtargets && err == MVP_SUCCESS; i++) {
+    targets[i]->path = (float*)malloc(tree->pathlength * sizeof(float));
+    if(targets[i]->path == NULL) {
+      err = MVP_MEMALLOC;
+      break;
+    }
+    nballoc++;
+    results[i] = (MVPDP**)malloc(knearest * sizeof(MVPDP*));
+    if(!results[i]) {
+      err = MVP_MEMALLOC;
+      break;
+    }
+    nbresults[i] = 0;
+    errors[i] = MVP_SUCCESS;
+    active[i] = i;
+  }
+
+  if(err == MVP_SUCCESS) {
+    MVPBatch batch;
+    batch.targets = targets;
+    batch.results = results;
+    batch.nbresults = nbresults;
+    batch.errors = errors;
+    batch.scratch = NULL;
+    batch.nbscratch = 0;
+    batch.scratchsize = nbtargets * (sizeof(MVPDP*) + 2 * sizeof(float) + 2 * sizeof(unsigned int));
+    tree->k = knearest;
+
+    switch(tree_metric(tree)) {
+    case MVP_HAMMING64:
+      _mvptree_retrieve_batch_hamming64(tree, tree->node, &batch, active, nbtargets, radius, 0);
+      break;
+    case MVP_HAMMING8:
+      _mvptree_retrieve_batch_hamming8(tree, tree->node, &batch, active, nbtargets, radius, 0);
+      break;
+    case MVP_CROSSCORR:
+      _mvptree_retrieve_batch_crosscorr(tree, tree->node, &batch, active, nbtargets, radius, 0);
+      break;
+    default:
+      _mvptree_retrieve_batch_custom(tree, tree->node, &batch, active, nbtargets, radius, 0);
+    }
+
+    for(i = 0; i < batch.nbscratch; i++) free(batch.scratch[i]);
+    free(batch.scratch);
+  }
+
+  for(i = 0; i < nballoc; i++) {
+    free(targets[i]->path);
+    targets[i]->path = NULL;
+  }
+  free(active);
+
+  if(err != MVP_SUCCESS) {
+    if(results) {
+      for(i = 0; i < nballoc; i++) free(results[i]);
+      free(results);
+      results = NULL;
+    }
+    for(i = 0; i < nbtargets; i++) errors[i] = err;
+  }
+
+  return results;
+}
+
 static off_t write_datapoint(MVPDP *dp, MVPTree *tree){
     off_t start = tree->pos;
     off_t pos = tree->pos;
@@ -835,7 +1210,8 @@ static off_t write_datapoint(MVPDP *dp, MVPTree *tree){
 	tree->pos = pos;
 	return start;
     }
-    active = 1;
+    /* tombstoned datapoints are written inactive, but with their data */
+    active = (dp->deleted) ? 0 : 1;
     uint8_t idlen = strlen(dp->id);
     uint32_t datalength = dp->datalen;
     uint8_t type = dp->type;
@@ -1035,6 +1411,7 @@ static MVPDP* read_datapoint(MVPTree *tree) {
 
   dp->path = (float*)malloc(tree->pathlength * sizeof(float));
   if(!dp->path) return NULL;
+  dp->deleted = (active == 0);
 
   memcpy(&idlen, &tree->buf[tree->pos], sizeof(uint8_t));
   tree->pos += sizeof(uint8_t);
@@ -1088,6 +1465,7 @@ static Node* _mvptree_read_node(MVPTree *tree, MVPError *error, int lvl) {
       tree->pos = offset;
       node->leaf.points[i] = read_datapoint(tree);
     }
+    pack_leaf(tree, node);
   } else if(node_type == INTERNAL_NODE) {
     int bf = tree->branchfactor;
     int lengthM1 = bf - 1;
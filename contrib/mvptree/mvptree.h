@@ -32,6 +32,15 @@ typedef enum mvp_datatype_t {
     MVP_UINT64ARRAY = 8 
 } MVPDataType;
 
+/* built-in distance metrics - a tree whose distance function is one of the */
+/* mvp_*_distance() functions below gets a specialized retrieval path        */
+typedef enum mvp_metric_t {
+    MVP_CUSTOM = 0,         /* user supplied distance function */
+    MVP_HAMMING64,          /* mvp_hamming64_distance() - e.g. dct image hashes */
+    MVP_HAMMING8,           /* mvp_hamming8_distance()  - e.g. mh image hashes */
+    MVP_CROSSCORR           /* mvp_crosscorr_distance() - e.g. radial image digests */
+} MVPMetric;
+
 typedef enum nodetype_t { 
     INTERNAL_NODE = 1, 
     LEAF_NODE 
@@ -66,6 +75,7 @@ typedef enum mvp_error_t {
     MVP_BADDISTVAL,         /* val from distance function either NaN or less than 0 */
     MVP_FILENOTFOUND,       /* file not found */
     MVP_UNRECOGNIZED,       /* unrecognized node */
+    MVP_IDNOTFOUND,         /* no datapoint with the given id in tree */
 } MVPError;
 
 typedef struct mvp_datapoint_t {
@@ -74,6 +84,7 @@ typedef struct mvp_datapoint_t {
     float *path;            /* path of distances of data point from all vantage points down tree*/
     unsigned int datalen;   /* length of data in the type designated */    
     MVPDataType type;       /* type of data (the bitwidth of each data element) */
+    int deleted;            /* tombstone, set by mvptree_delete() */
 } MVPDP;
 
 
@@ -81,6 +92,10 @@ typedef struct mvp_datapoint_t {
 /* call back function for mvp tree functions - to performa distance calc.'s*/
 typedef float (*CmpFunc)(MVPDP *pointA, MVPDP *pointB);
 
+/* optional call back function to calculate the distances of a list of points from one   */
+/* point in a single call, e.g. with a SIMD kernel - dists[i] = distance(points[i], point) */
+typedef void (*CmpBatchFunc)(MVPDP *point, MVPDP **points, unsigned int nbpoints, float *dists);
+
 /* Callback function to pass to mvp_clear() to free id and data members of the datapoints, */
 /* since the id and data arrays are allocated by user, not by dp_alloc() function. */
 typedef void  (*MVPFreeFunc)(void *ptr);
@@ -98,6 +113,8 @@ typedef struct node_leaf_t {
     MVPDP **points;
     float *d1, *d2;
     unsigned int nbpoints;
+    void *packed;              /* copy of the points' data for the hamming metrics (internal use) */
+    unsigned int packedlen;    /* datalen of each point in packed (internal use) */
 } LeafNode;
    
 
@@ -122,6 +139,8 @@ typedef struct mvptree_t {
     char *buf;             /* internal use                                            */
     Node *node;            /* reference to top of tree                                */
     CmpFunc dist;          /* distance function - e.g. L1 or L2                       */
+    CmpBatchFunc batchdist;/* optional one-to-many distance function used by          */
+                           /* mvptree_retrieve_batch() (NULL to loop over dist)       */
 } MVPTree;
 
 
@@ -161,6 +180,47 @@ MVPDP* dp_alloc(MVPDataType type);
 
 void dp_free(MVPDP *dp, MVPFreeFunc free_func);
 
+/*   mvp_hamming64_distance
+ *
+ *   DESCRIPTION:
+ *
+ *   built-in distance function for MVP_UINT64ARRAY datapoints: the number of bits that
+ *   differ between the two arrays (e.g. the hamming distance between dct image hashes)
+ *
+ *   RETURN:
+ *
+ *   float distance, -1.0 if the datapoints differ in type or length
+ */
+float mvp_hamming64_distance(MVPDP *pointA, MVPDP *pointB);
+
+/*   mvp_hamming8_distance
+ *
+ *   DESCRIPTION:
+ *
+ *   built-in distance function for MVP_BYTEARRAY datapoints: the fraction of bits that
+ *   differ between the two arrays (e.g. the normalized hamming distance between mh
+ *   image hashes, as ph_mh_hammingdistance() does)
+ *
+ *   RETURN:
+ *
+ *   float distance in the range [0, 1], -1.0 if the datapoints differ in type or length
+ */
+float mvp_hamming8_distance(MVPDP *pointA, MVPDP *pointB);
+
+/*   mvp_crosscorr_distance
+ *
+ *   DESCRIPTION:
+ *
+ *   built-in distance function for MVP_BYTEARRAY datapoints: 1 minus the peak of the
+ *   cross correlation of the two arrays (e.g. radial image digests, as ph_crosscorr()
+ *   does)
+ *
+ *   RETURN:
+ *
+ *   float distance in the range [0, 1], -1.0 if the datapoints differ in type or length
+ */
+float mvp_crosscorr_distance(MVPDP *pointA, MVPDP *pointB);
+
 /*   mvptree_alloc
  * 
  *   DESCRIPTION:
@@ -169,7 +229,9 @@ void dp_free(MVPDP *dp, MVPFreeFunc free_func);
  *
  *   tree - ptr to MVPTree to initialize (NULL to allocate one on the heap 
  *
- *   distance - callback function (the distance function to use in the mvp tree
+ *   distance - callback function (the distance function to use in the mvp tree. Pass
+ *              one of the built-in mvp_*_distance() functions to have the distance
+ *              calculations inlined into the tree traversal)
  *   
  *    bf - int value for the tree branch factor - e.g. 2
  *
@@ -234,6 +296,58 @@ void mvptree_clear(MVPTree *tree, MVPFreeFunc free_func);
 
 MVPError mvptree_add(MVPTree *tree, MVPDP **points, unsigned int nbpoints);
 
+/*
+ *   mvptree_delete
+ *
+ *   DESCRIPTION:
+ *
+ *   delete the datapoints with the given id from the tree. The datapoints are only
+ *   tombstoned: they stay in the tree, where they may still serve as vantage points,
+ *   but are no longer returned by mvptree_retrieve() or mvptree_retrieve_batch().
+ *   Tombstones are kept by mvptree_write() and mvptree_read(). Call mvptree_compact()
+ *   to remove them.
+ *
+ *   ARGUMENTS:
+ *
+ *   tree - ptr to the MVPTree
+ *
+ *   id - null-terminated id string of the datapoints to delete
+ *
+ *   RETURN:
+ *
+ *   MVPError error code, MVP_IDNOTFOUND if no live datapoint has this id
+ */
+
+MVPError mvptree_delete(MVPTree *tree, const char *id);
+
+/*
+ *   mvptree_compact
+ *
+ *   DESCRIPTION:
+ *
+ *   remove the tombstoned datapoints from the tree. Only the subtrees in which the
+ *   fraction of tombstoned datapoints exceeds ratio are rebuilt, from their remaining
+ *   datapoints; the rest of the tree is left as is. Each rebuild is local to its
+ *   subtree, so compaction can be run now and then on a live index, serialized with
+ *   calls to mvptree_add() and the retrieve functions.
+ *
+ *   ARGUMENTS:
+ *
+ *   tree - ptr to the MVPTree
+ *
+ *   ratio - tombstone ratio in [0, 1) above which a subtree is rebuilt, e.g. 0.25.
+ *           0.0 removes every tombstone.
+ *
+ *   free_func - callback function used to free the id and data of the removed
+ *               datapoints (See mvptree_clear())
+ *
+ *   RETURN:
+ *
+ *   MVPError error code
+ */
+
+MVPError mvptree_compact(MVPTree *tree, float ratio, MVPFreeFunc free_func);
+
 /*
  *   mvptree_retrieve
  *  
@@ -265,6 +379,45 @@ MVPError mvptree_add(MVPTree *tree, MVPDP **points, unsigned int nbpoints);
 MVPDP** mvptree_retrieve(MVPTree *tree, MVPDP *target, unsigned int knearest, float radius,\
                                        unsigned int *nbresults, MVPError *error);
 
+/*
+ *   mvptree_retrieve_batch
+ *
+ *   DESCRIPTION:
+ *
+ *   retrieve knearest neighbors for a block of targets with one traversal of the tree.
+ *   The targets are pushed down the tree together: the vantage point distances for
+ *   all targets at a node are computed at once (with tree->batchdist if set, else with
+ *   the built-in block kernels of the hamming metrics), and the block is split at each
+ *   branch. The results for each target are the same as for a call to
+ *   mvptree_retrieve() on that target.
+ *
+ *   ARGUMENTS:
+ *
+ *   tree - ptr to the MVPTree
+ *
+ *   targets - array of target datapoint ptrs
+ *
+ *   nbtargets - number of targets in the targets array
+ *
+ *   knearest - maximum number of datapoints to return for each target
+ *
+ *   radius   -  distance from a target to include in its returned list.
+ *
+ *   nbresults - array of nbtargets ints to contain the number of results for each target.
+ *
+ *   errors - array of nbtargets error values, one for each target
+ *
+ *   RETURN:
+ *
+ *   MVPDP*** array of nbtargets result arrays, NULL on error (errors are all set to the
+ *            error code). The user must free each result array and the returned array,
+ *            but not the datapoints.
+ *
+ */
+
+MVPDP*** mvptree_retrieve_batch(MVPTree *tree, MVPDP **targets, unsigned int nbtargets,\
+                 unsigned int knearest, float radius, unsigned int *nbresults, MVPError *errors);
+
 /*
  *   mvptree_write
  *
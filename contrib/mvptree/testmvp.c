@@ -29,6 +29,7 @@
 #include <time.h>
 #include <assert.h>
 #include "mvptree.h"
+#include "mvpshard.h"
 
 #define MVP_BRANCHFACTOR 2
 #define MVP_PATHLENGTH   5
@@ -239,13 +240,109 @@ int main(int argc, char **argv){
 	fprintf(stdout,"No results found - %s\n", mvp_errstr(err));
     }
 
-    fprintf(stdout,"------------------Results %d (%d calcs)---------\n",nbresults,nbcalcs);
+    fprintf(stdout,"------------------Results %d (%llu calcs)---------\n",nbresults,nbcalcs);
     unsigned int i;
     for (i = 0;i < nbresults;i++){
 	fprintf(stdout,"(%d) %s\n", i, results[i]->id);
     }
     fprintf(stdout,"------------------------------------------------\n\n");
+
+    fprintf(stdout,"------------------Batch retrieve cluster--------\n");
+    unsigned int *nbbatch = (unsigned int*)malloc(nbcluster1*sizeof(unsigned int));
+    MVPError *errs = (MVPError*)malloc(nbcluster1*sizeof(MVPError));
+    assert(nbbatch && errs);
+    nbcalcs = 0;
+    MVPDP ***batchresults = mvptree_retrieve_batch(tree, cluster1, nbcluster1, knearest, radius, \
+                                                   nbbatch, errs);
+    assert(batchresults);
+    assert(nbbatch[0] == nbresults);
+    for (i = 0;i < nbresults;i++){
+	assert(batchresults[0][i] == results[i]);
+    }
+    for (i = 0;i < nbcluster1;i++){
+	fprintf(stdout,"(%d) %s - %d results, %s\n", i, cluster1[i]->id, nbbatch[i], mvp_errstr(errs[i]));
+	free(batchresults[i]);
+    }
+    fprintf(stdout,"(%llu calcs)\n", nbcalcs);
+    fprintf(stdout,"------------------------------------------------\n\n");
+    free(batchresults);
+    free(nbbatch);
+    free(errs);
+
+    if (nbresults > 0){
+	char *id = strdup(results[0]->id);
+	assert(id);
+	fprintf(stdout,"------------------Delete %s----------------\n", id);
+	err = mvptree_delete(tree, id);
+	assert(err == MVP_SUCCESS);
+	assert(mvptree_delete(tree, id) == MVP_IDNOTFOUND);
+
+	unsigned int nbremaining = 0;
+	MVPDP **remaining = mvptree_retrieve(tree, cluster1[0], knearest, radius, &nbremaining, &err);
+	assert(nbremaining == nbresults - 1);
+	for (i = 0;i < nbremaining;i++){
+	    assert(strcmp(remaining[i]->id, id));
+	}
+	free(remaining);
+
+	err = mvptree_compact(tree, 0.0f, free);
+	fprintf(stdout,"compact - %s\n", mvp_errstr(err));
+	remaining = mvptree_retrieve(tree, cluster1[0], knearest, radius, &nbremaining, &err);
+	assert(nbremaining == nbresults - 1);
+	fprintf(stdout,"%d results after delete\n", nbremaining);
+	fprintf(stdout,"------------------------------------------------\n\n");
+	free(remaining);
+	free(id);
+    }
+    free(results);
+
+    fprintf(stdout,"------------------Sharded retrieve cluster------\n");
+    MVPShards *shards = mvpshards_alloc(4, MVP_PARTITION_ROUNDROBIN, 2, distance_func, \
+                                        MVP_BRANCHFACTOR, MVP_PATHLENGTH, MVP_LEAFCAP);
+    assert(shards);
+    MVPDP **shardpoints = generate_uniform_points(nbpoints, dplength);
+    MVPDP **cluster2 = generate_cluster(nbcluster1, dplength, var, distance_func);
+    assert(shardpoints && cluster2);
+    err = mvpshards_add(shards, shardpoints, nbpoints);
+    assert(err == MVP_SUCCESS);
+    err = mvpshards_add(shards, cluster2, nbcluster1);
+    assert(err == MVP_SUCCESS);
+
+    /* query with a copy of the cluster center, the shards own the original */
+    MVPDP *center = generate_point(dplength);
+    assert(center);
+    memcpy(center->data, cluster2[0]->data, dplength);
+
+    results = mvpshards_retrieve(shards, center, knearest, radius, &nbresults, &err);
+    assert(results);
+    for (i = 0;i < nbresults;i++){
+	float d = distance_func(center, results[i]);
+	assert(i == 0 || d >= distance_func(center, results[i-1]));
+	fprintf(stdout,"(%d) %s - %f\n", i, results[i]->id, d);
+    }
+    free(results);
+
+    /* serve shard 0 from a file, through the stand-in for remote shards */
+    const char *shardfile = "testshard.mvp";
+    err = mvpshards_save(shards, 0, shardfile, 00755);
+    assert(err == MVP_SUCCESS);
+    mvpshards_unload(shards, 0, free);
+    void *ctx = mvpshard_stub_open(shardfile, distance_func, MVP_BRANCHFACTOR, MVP_PATHLENGTH, \
+                                   MVP_LEAFCAP, &err);
+    assert(ctx);
+    err = mvpshards_attach(shards, 0, mvpshard_stub_retrieve, mvpshard_stub_close, ctx);
+    assert(err == MVP_SUCCESS);
+
+    unsigned int nbsharded = nbresults;
+    results = mvpshards_retrieve(shards, center, knearest, radius, &nbresults, &err);
+    assert(results && nbresults == nbsharded);
+    fprintf(stdout,"%d results with remote shard, %s\n", nbresults, mvp_errstr(err));
+    fprintf(stdout,"------------------------------------------------\n\n");
     free(results);
+    mvpshards_free(shards, free);
+    dp_free(center, free);
+    free(shardpoints);
+    free(cluster2);
 
     mvptree_clear(tree, free);
     free(tree);
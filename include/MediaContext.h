@@ -42,11 +42,16 @@ public:
   AVFrame* GetDestFrame() const { return m_pFrameDst; }
   void SetIndexNextFrame(uint64_t value) { m_idxFrameNext = value; }
   void SetNumRetrieveFrames(int value) { m_numFrameRetrieve = value; }
+  void SetNumThreads(int value) { m_numThreads = value; }
+  void SetKeyFramesOnly(bool value) { m_isKeyFramesOnly = value; }
+  void SetFastDecode(bool value) { m_isFastDecode = value; }
 
   bool Open();
   bool IsOpen() const;
+  bool Reopen(const char* filename);
   bool Close();
   bool SetDimensions(int width, int height);
+  bool SetThumbnailDimensions(int width, int height);
   bool OpenStream(StreamType type, int index);
   bool Reset();
   bool IsStreamOpen() const;
@@ -55,21 +60,30 @@ public:
 
   bool AllocateBuffers();
   bool DecodeVideoFrame(const AVPacket& packet);
+  bool FlushVideoFrame();
   bool IsDecodeVideoFinished() const;
   bool IsNextFrameIndex() const;
   void StepNextFrameIndex();
   bool ReadCurrentFrame(CImageI& image) const;
+  bool ReadCurrentThumbnail(CImageI& image) const;
   bool FreeBuffers();
+  bool FreeThumbnailBuffers();
 
 private:
   int GetNumberVideoFrames() const;
+  int GetScaleFlags() const;
+  void ScaleCurrentFrame(SwsContext* pSwsContext, AVFrame* pFrameDst, int width, int height, CImageI& image) const;
 
 public:
   static void Initialize();
   static MediaContextPtr Create(const char* filename);
+  static MediaContextPtr Acquire(const char* filename);
   static bool IsStreamType(StreamType type, AVMediaType n);
 
 private:
+  // Highest lowres level of the fast decode, a quarter of the width and height
+  static const int MAX_LOWRES = 2;
+
   AVFormatContext* m_pFormatCtx;
   AVStream*        m_pStream;
   AVCodec*         m_pCodec;
@@ -78,6 +92,11 @@ private:
   AVCodecContext*  m_pCodecCtx;
   SwsContext*      m_pSwsContext;
   uint8_t*         m_pBuffer;
+  int              m_bufferSize;
+  AVFrame*         m_pFrameThumb;
+  SwsContext*      m_pThumbSwsContext;
+  uint8_t*         m_pThumbBuffer;
+  int              m_thumbBufferSize;
   AVPixelFormat    m_pixelFormat;
   int64_t          m_pts;
   uint64_t         m_idxFrameCur;
@@ -85,12 +104,17 @@ private:
   int              m_idxFrameStep;
   int              m_numFrames;
   int              m_numFrameRetrieve;
+  int              m_numThreads;
   int              m_idxStream;
   int              m_width;
   int              m_height;
+  int              m_thumbWidth;
+  int              m_thumbHeight;
   float            m_fps;
   bool             m_isOpen;
   bool             m_isFrameFinished;
+  bool             m_isKeyFramesOnly;
+  bool             m_isFastDecode;
   const char*      m_filename;
 };
 
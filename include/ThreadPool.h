@@ -0,0 +1,59 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads fed by a bounded queue of tasks. Without pthread support,
+// or with a single thread requested, tasks run in the thread that submits them.
+class ThreadPool {
+public:
+  // numThreads of 0 starts one thread per core. Submit() blocks while maxQueued tasks
+  // are waiting, 0 allowing two per thread.
+  explicit ThreadPool(int numThreads = 0, int maxQueued = 0);
+  ~ThreadPool();
+
+  int GetNumThreads() const { return static_cast<int>(m_threads.size()); }
+
+  template<typename F>
+  auto Submit(F&& task) -> std::future<decltype(task())>;
+
+private:
+  void Push(std::function<void()> task);
+  void Run();
+
+public:
+  static int GetNumCores();
+
+private:
+  std::vector<std::thread>          m_threads;
+  std::deque<std::function<void()>> m_tasks;
+  std::mutex                        m_mutex;
+  std::condition_variable           m_notEmpty;
+  std::condition_variable           m_notFull;
+  size_t                            m_maxQueued;
+  bool                              m_stop;
+};
+
+template<typename F>
+auto ThreadPool::Submit(F&& task) -> std::future<decltype(task())> {
+  using R = decltype(task());
+
+  auto pTask = std::make_shared<std::packaged_task<R()>>(std::forward<F>(task));
+  auto result = pTask->get_future();
+  if(m_threads.empty()) {
+    (*pTask)();
+  } else {
+    Push([pTask] { (*pTask)(); });
+  }
+
+  return result;
+}
+
+#endif /* THREADPOOL_H */
@@ -1,27 +1,97 @@
 #ifndef VIDEOPROCESSOR_H
 #define VIDEOPROCESSOR_H
 
+#include <array>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include "internal.h"
 #include "MediaContext.h"
+#include "ThreadPool.h"
+
+// Called with the keyframe of each scene as soon as the scene closes; returns false to
+// stop reading the video
+using KeyframeCallback = std::function<bool(const CImageI&)>;
+
+// How the frames of a video are decoded and sampled
+struct DecodeOptions {
+  bool keyFramesOnly = false;   // decode only the key frames, and sample each of them
+  bool fastDecode = false;      // decode at a lower resolution and quality, scale bilinear
+  int numThreads = 0;           // decoder threads, 0 for one per core
+};
+
+// Images of the frames of a video, recycled once released rather than allocated for each frame
+class FrameArena {
+public:
+  FrameArena();
+
+  // Image returned to the arena when its last pointer is released, from any thread
+  CImageIPtr Acquire();
+
+private:
+  struct Pool {
+    std::mutex                            mutex;
+    std::vector<std::unique_ptr<CImageI>> images;
+  };
+
+  std::shared_ptr<Pool> m_pPool;
+};
 
 class VideoProcessor {
 protected:
   explicit VideoProcessor(MediaContextPtr pContext);
 
 private:
-  int ReadFrames(CImageIListPtr pFrameList) const;
+  // Reads the next sampled frame and its thumbnail: 1 when read, 0 at the end of the video,
+  // -1 on error
+  int ReadFrame(CImageI& frame, CImageI& thumb) const;
+
+  bool DetectSceneChanges(const KeyframeCallback& onKeyframe, ThreadPool& pool) const;
+
+  // 64 bin histogram of a gray frame, binned as CImg's get_histogram(64, 0, 255)
+  using Histogram = std::array<uint32_t, 64>;
+
+  static void CalculateHistogram(const CImageI& frame, Histogram& hist);
+
+  static float CalculateHistogramDifference(const Histogram& hist, const Histogram& prev);
 
-  bool CalculateFrameDifferential(float* pFrameDiff) const;
+  // Scene boundary test of the frames in increasing order, over the ring of their differences.
+  // The local maximum is kept up to date in a monotonic deque as the window slides. The mean
+  // absolute deviation of the global window cannot be kept that way, so the global statistics
+  // are only computed for the frames that are a local maximum above the local threshold.
+  class BoundryDetector {
+  public:
+    explicit BoundryDetector(const float* pFrameDiff);
 
-  std::vector<uint64_t> CalculateBoundryFrames(float* pFrameDiff) const;
+    bool IsBoundryFrame(int idxFrame, int numFrames);
+
+  private:
+    const float*    m_pFrameDiff;
+    std::deque<int> m_maxima;
+    int             m_idxNext;
+  };
 
 public:
+  // Histograms are computed on the threads of pPool, or of a pool of one thread per core
+  static bool GetSceneChangeFrames(const char* filename, const KeyframeCallback& onKeyframe, const DecodeOptions& options = DecodeOptions(), ThreadPool* pPool = nullptr);
   static CImageIListPtr GetSceneChangeFrames(const char* filename);
 
 private:
+  // Half widths of the windows around a frame used to detect a scene boundary: the local
+  // maxima are searched within +/-S frames, the average difference is taken over +/-L
+  static const int S = 10;
+  static const int L = 50;
+
+  // Number of frame differences kept: those within +/-L of the oldest frame not settled yet
+  static const int DIFF_RING = 2 * L + 1;
+
+  // Size of the thumbnails from which the keyframes are taken
+  static const int THUMB_SIZE = 32;
+
   MediaContextPtr m_pContext;
 };
 
@@ -41,7 +41,18 @@ extern "C" {
 */
 int ph_count_samples(const char *filename, int sr,int channels);
 
+/* sample rate conversion of ph_readaudio */
+typedef enum ph_resample_quality {
+    PH_RESAMPLE_LINEAR = 0,  /* libsamplerate linear interpolation */
+    PH_RESAMPLE_FAST,        /* built-in polyphase filter, short */
+    PH_RESAMPLE_HIGH         /* built-in polyphase filter, long */
+} ph_resample_quality;
+
 /* /brief read audio 
+ *
+ * The built-in polyphase filters are precomputed for each pair of rates, and take any
+ * pair whose ratio reduces to a small fraction, as 44100 or 48000 to 8000. Other pairs
+ * fall back to the sinc converters of libsamplerate.
  *
  * /param filename - path and name of audio file to read
  * /param sr - sample rate conversion
@@ -49,9 +60,27 @@ int ph_count_samples(const char *filename, int sr,int channels);
  * /param buf - preallocated buffer 
  * /param buflen - (in/out) param for buf length
  * /param nbsecs - float value for duration (in secs) to read from file
+ * /param quality - sample rate conversion, the hashes depending on it
+ * /return float* - float pointer to start of buffer - one channel of audio, NULL if error
+ */
+float* ph_readaudio(const char *filename, int sr, int channels, float *sigbuf, int &buflen, const float nbsecs = 0,
+                    const ph_resample_quality quality = PH_RESAMPLE_LINEAR);
+
+/* /brief read a range of audio
+ *
+ * Seeks to start_sec rather than decoding the file up to there.
+ *
+ * /param filename - path and name of audio file to read
+ * /param sr - sample rate conversion
+ * /param buf - preallocated buffer 
+ * /param buflen - (in/out) param for buf length
+ * /param start_sec - float value for start (in secs) of the range
+ * /param duration_sec - float value for duration (in secs) of the range, 0 to the end of the file
+ * /param quality - sample rate conversion
  * /return float* - float pointer to start of buffer - one channel of audio, NULL if error
  */
-float* ph_readaudio(const char *filename, int sr, int channels, float *sigbuf, int &buflen, const float nbsecs = 0);
+float* ph_readaudio_range(const char *filename, int sr, float *sigbuf, int &buflen, const float start_sec,
+                          const float duration_sec, const ph_resample_quality quality = PH_RESAMPLE_LINEAR);
 
 /* /brief audio hash calculation
  * purpose: hash calculation for each frame in the buffer.
@@ -59,13 +88,75 @@ float* ph_readaudio(const char *filename, int sr, int channels, float *sigbuf, i
  *          The value is based on the bark scale values of the frame fft spectrum. The value
  *          computed from temporal and spectral differences on the bark scale.
  * 
+ *          The frames are split into ranges hashed on several threads, each range first
+ *          hashing the frame before it for its bark values, so the hashes are the same
+ *          whatever the number of threads.
+ * 
  * /param buf - pointer to start of buffer
  * /param N   - length of buffer
  * /param sr  - sample rate on which to base the audiohash
  * /param nb_frames - (out) number of frames in audio buf and length of audiohash buffer returned
+ * /param threads - number of threads, 0 for one per core
  * /return uint32 pointer to audio hash, NULL for error
 */
-uint32_t* ph_audiohash(float *buf, int nbbuf, const int sr, int &nbframes);
+uint32_t* ph_audiohash(float *buf, int nbbuf, const int sr, int &nbframes, const int threads = 1);
+
+/* /brief call back receiving the frame hashes of a streamed audio hash
+ * /param hash - uint32_t hash of the frame
+ * /param arg  - user argument passed to ph_audiohash_begin
+ * /return int - 0 to stop hashing, non-zero to go on
+ */
+typedef int (*ph_audiohash_cb)(uint32_t hash, void *arg);
+
+/* state of a streamed audio hash (opaque) */
+typedef struct ph_audiohash_state ph_audiohash_state;
+
+/* /brief start a streamed audio hash
+ * purpose: same hashes as ph_audiohash, computed as the signal is fed in chunks of any
+ *          length, e.g. from a decoder, a pipe or a live stream, in constant memory.
+ *
+ * /param sr       - sample rate of the signal, as for ph_audiohash
+ * /param callback - function called with the hash of each frame, in order, as soon as the
+ *                   frame is complete
+ * /param arg      - user argument passed to callback
+ * /return ph_audiohash_state* - state to feed, NULL for error
+ */
+ph_audiohash_state* ph_audiohash_begin(const int sr, ph_audiohash_cb callback, void *arg);
+
+/* /brief feed the next samples of the signal to a streamed audio hash
+ * /param state - state from ph_audiohash_begin
+ * /param buf   - next samples, one channel
+ * /param N     - number of samples in buf
+ * /return int - number of hashes passed to the callback during the call, negative for error.
+ *               Once the callback returns 0, further samples are ignored.
+ */
+int ph_audiohash_feed(ph_audiohash_state *state, const float *buf, const int N);
+
+/* /brief finish a streamed audio hash, freeing its state
+ * /param state - state from ph_audiohash_begin
+ * /return int - total number of hashes passed to the callback, negative for error
+ */
+int ph_audiohash_end(ph_audiohash_state *state);
+
+/* /brief audio hash of a file, hashed in chunks on several threads
+ * purpose: the file is split into chunks of chunk_secs, each read from a seek to its start
+ *          and hashed on its own thread. A chunk is read from a little before its start, for
+ *          the resampler to settle and for its first frame to be compared with the frame
+ *          before it, so the hashes of the chunks join into the frames of ph_audiohash over
+ *          the whole file. With the built-in converters, and files whose seeks are sample
+ *          exact, the hashes are the same bit for bit; the linear converter of libsamplerate
+ *          may flip a few bits near the joins.
+ *
+ * /param filename   - path and name of audio file
+ * /param sr         - sample rate of the hash
+ * /param chunk_secs - length of the chunks, 0 to hash the file in one piece
+ * /param threads    - number of threads, 0 for one per core
+ * /param nbframes   - (out) number of hashes
+ * /param quality    - sample rate conversion
+ * /return uint32_t* - frame hashes, NULL for error
+ */
+uint32_t* ph_audiohash_chunked(const char *filename, const int sr, const float chunk_secs, const int threads,
+                               int &nbframes, const ph_resample_quality quality = PH_RESAMPLE_LINEAR);
 
 ph_datapoint **ph_audio_hashes(char *files[], int count, int sr = 8000, int channels = 1, int threads = 0);
 
@@ -96,6 +187,19 @@ double ph_compare_blocks(const uint32_t *ptr_blockA,const uint32_t *ptr_blockB,
  */
 double* ph_audio_distance_ber(uint32_t *hash_a , const int Na, uint32_t *hash_b, const int Nb, const float threshold, const int block_size, int &Nc);
 
+/* /brief distance function between two hashes, at the offsets where they share hashes
+ * purpose: same scores as ph_audio_distance_ber, computed only at the offsets aligning at
+ *          least min_matches identical frame hashes of both signals. A clip found in a
+ *          longer signal shares exact hashes with it at the right offset, so only a few
+ *          offsets need scoring instead of all of them.
+ *
+ * /param hash_a, Na, hash_b, Nb, threshold, block_size - see ph_audio_distance_ber
+ * /param Nc     - (out) length of confidence score vector
+ * /param min_matches - identical hashes needed for an offset to be scored, 0 for all offsets
+ * /return double - ptr to confidence score vector, 0 at the offsets not scored
+ */
+double* ph_audio_distance_ber_seeded(uint32_t *hash_a , const int Na, uint32_t *hash_b, const int Nb, const float threshold, const int block_size, int &Nc, const int min_matches);
+
 }
 
 #endif /* HAVE_AUDIO_HASH */
@@ -0,0 +1,117 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+#ifndef AUDIO_INDEX_H
+#define AUDIO_INDEX_H
+
+#include "config.h"
+#if HAVE_AUDIO_HASH
+
+#include <stdint.h>
+
+extern "C" {
+
+/* inverted index of the frame hashes of a set of tracks (opaque). Each 32 bit frame hash
+ * maps to the list of (track, offset) where it occurs, and the index keeps the hashes of
+ * the tracks to verify the matches. Tracks are numbered in the order given to
+ * ph_audio_index_build.
+ */
+typedef struct ph_audio_index ph_audio_index;
+
+/* track matching a query */
+typedef struct ph_audio_match {
+    int track;          /* number of the track in the index */
+    int offset;         /* frame of the track aligned to the first frame of the query,
+                           negative if the query starts before the track */
+    int votes;          /* hashes of the query found at this offset */
+    double confidence;  /* ph_audio_distance_ber score of the query at this offset */
+} ph_audio_match;
+
+/* /brief build an index of the hashes of a set of tracks
+ *
+ * /param hashes   - frame hashes of each track, as from ph_audiohash
+ * /param lengths  - number of hashes of each track
+ * /param nbtracks - number of tracks
+ * /param threads  - number of threads building the index, 0 for one per core
+ * /return ph_audio_index* - index, NULL for error
+ */
+ph_audio_index* ph_audio_index_build(uint32_t **hashes, const int *lengths, const int nbtracks, const int threads = 0);
+
+/* /brief write an index to a file, to be mapped by ph_audio_index_open
+ *
+ * The file is in the byte order of the machine that builds it.
+ *
+ * /param index    - index to write
+ * /param filename - file to write
+ * /return int - 0 for success, negative for error
+ */
+int ph_audio_index_save(const ph_audio_index *index, const char *filename);
+
+/* /brief map an index file written by ph_audio_index_save
+ *
+ * The file is mapped read-only rather than read, so opening is immediate whatever its size,
+ * and processes querying the same index share its pages.
+ *
+ * /param filename - file to map
+ * /return ph_audio_index* - index, NULL for error
+ */
+ph_audio_index* ph_audio_index_open(const char *filename);
+
+/* /brief free an index, unmapping its file
+ * /param index - index from ph_audio_index_build or ph_audio_index_open
+ */
+void ph_audio_index_free(ph_audio_index *index);
+
+/* /brief number of tracks in an index
+ * /param index - index
+ * /return int - number of tracks
+ */
+int ph_audio_index_nbtracks(const ph_audio_index *index);
+
+/* /brief find the tracks containing a clip
+ * purpose: each hash of the query, and its neighbours within max_flips bits, votes for the
+ *          (track, offset) of every occurrence in the index, offset being relative to the
+ *          first hash of the query. The offsets with the most votes are then scored with
+ *          ph_audio_distance_ber over the frames where the query and the track overlap.
+ *          Hashes occurring in too many places, like those of silence, do not vote.
+ *
+ * /param index       - index
+ * /param hash        - frame hashes of the query
+ * /param N           - number of hashes of the query
+ * /param max_flips   - 0 to look up the hashes of the query as they are, 1 or 2 to also look
+ *                      up the hashes differing by up to that many bits, for noisier queries
+ * /param threshold   - see ph_audio_distance_ber
+ * /param block_size  - see ph_audio_distance_ber
+ * /param matches     - (out) best matches, highest confidence first
+ * /param max_matches - length of matches
+ * /return int - number of matches, negative for error
+ */
+int ph_audio_index_query(const ph_audio_index *index, const uint32_t *hash, const int N, const int max_flips,
+                         const float threshold, const int block_size, ph_audio_match *matches, const int max_matches);
+
+}
+
+#endif /* HAVE_AUDIO_HASH */
+
+#endif /* AUDIO_INDEX_H */
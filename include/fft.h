@@ -25,8 +25,55 @@
 #ifndef FFT_H
 #define FFT_H
 
-struct complex;
+#include <memory>
+#include <vector>
 
+struct complex {
+  complex() = default;
+
+  complex(double r, double i)
+    : x{ r }
+    , y{ i } {}
+
+  inline complex operator+(const complex b) const {
+    return complex(x + b.x, y + b.y);
+  }
+
+  inline complex operator-(const complex b) const {
+    return complex(x - b.x, y - b.y);
+  }
+
+  inline complex operator*(const complex b) const {
+    return complex((x * b.x) - (y * b.y), (x * b.y) + (y * b.x));
+  }
+
+  double x, y; // real and imaginary parts
+};
+
+// Transform of real signals of a given power of two length, computed as a complex
+// transform of half the length. Bins follow X[k] = sum x[n] exp(+2 pi i k n / N), the
+// sign used by fft() from the start, the conjugate of the usual forward transform.
+class FFTPlan {
+public:
+  explicit FFTPlan(int N);
+
+  int GetSize() const { return m_size; }
+
+  // Writes the N / 2 + 1 bins of the spectrum of x[0..N-1] to X[0..N/2].
+  void Execute(const double* x, complex* X) const;
+
+  // Plan shared by all callers transforming N samples, created on the first call.
+  // nullptr if N is not a power of two.
+  static std::shared_ptr<const FFTPlan> Get(int N);
+
+private:
+  int                  m_size;
+  std::vector<int>     m_bitReverse;    // of the N / 2 point transform
+  std::vector<complex> m_twiddles;      // of each stage, len / 2 for len = 2, 4, .. N / 2
+  std::vector<complex> m_realTwiddles;  // exp(+2 pi i k / N), k = 0 .. N / 4
+};
+
+// Full spectrum of x[0..N-1] in X[0..N-1], N a power of two. Returns -1 for other N.
 int fft(const double* x, const int N, complex* X);
 
 #endif
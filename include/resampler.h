@@ -0,0 +1,61 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    David Starkweather - dstarkweather@phash.org
+
+*/
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include "audiohash.h"
+
+// Sample rate converter of a single channel, fed the signal block by block.
+class Resampler {
+public:
+  virtual ~Resampler() {}
+
+  // Converts the n samples of in, the last ones of the signal if eof, into out[0..outlen-1].
+  // Sets used to the number of samples of in consumed. Returns the number of samples
+  // written, negative for error. After eof, call again with no input until it returns 0.
+  virtual long Process(const float *in, long n, bool eof, float *out, long outlen, long &used) = 0;
+
+  // Starts a new signal.
+  virtual void Reset() = 0;
+
+  // Converter from sr_in to sr_out, valid until the calling thread's next call. The thread's
+  // converter is reset and reused when the rates and quality are those of its previous
+  // call, and replaced otherwise. The built-in converter takes the ratios reducing to L / M
+  // with L up to 1024; PH_RESAMPLE_LINEAR and the other ratios use libsamplerate.
+  // nullptr if the rates are not supported.
+  static Resampler* Get(long sr_in, long sr_out, ph_resample_quality quality);
+
+protected:
+  Resampler(long sr_in, long sr_out, ph_resample_quality quality)
+    : m_srIn{ sr_in }
+    , m_srOut{ sr_out }
+    , m_quality{ quality } {}
+
+  long                m_srIn;
+  long                m_srOut;
+  ph_resample_quality m_quality;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #include "MediaContext.h"
 #include "phash.h"
 #include <iostream>
+#include <mutex>
 
 static void print_error(const char *msg, int err) {
   char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
@@ -22,8 +23,11 @@ static void print_error(const char *msg, int err) {
 }
 
 void MediaContext::Initialize() {
-  av_log_set_level(AV_LOG_QUIET);
-  av_register_all();
+  static std::once_flag initialized;
+  std::call_once(initialized, [] {
+    av_log_set_level(AV_LOG_QUIET);
+    av_register_all();
+  });
 }
 
 MediaContextPtr MediaContext::Create(const char* filename) {
@@ -35,6 +39,21 @@ MediaContextPtr MediaContext::Create(const char* filename) {
   return nullptr;
 }
 
+MediaContextPtr MediaContext::Acquire(const char* filename) {
+  // Each thread keeps a context whose frames, buffers and scalers are reused for the next
+  // file, unless it is still in use
+  static thread_local MediaContextPtr pCached;
+  if(pCached != nullptr && pCached.use_count() == 1) {
+    return pCached->Reopen(filename) ? pCached : nullptr;
+  }
+
+  auto context = Create(filename);
+  if(pCached == nullptr)
+    pCached = context;
+
+  return context;
+}
+
 bool MediaContext::IsStreamType(StreamType type, AVMediaType n) {
   auto result = false;
   if(type == StreamType::Video) {
@@ -63,6 +82,11 @@ MediaContext::MediaContext(const char* filename)
   , m_pCodecCtx(nullptr)
   , m_pSwsContext(nullptr)
   , m_pBuffer(nullptr)
+  , m_bufferSize(0)
+  , m_pFrameThumb(nullptr)
+  , m_pThumbSwsContext(nullptr)
+  , m_pThumbBuffer(nullptr)
+  , m_thumbBufferSize(0)
   , m_pixelFormat(AVPixelFormat::AV_PIX_FMT_GRAY8)
   , m_pts(0)
   , m_idxFrameCur(0)
@@ -70,16 +94,27 @@ MediaContext::MediaContext(const char* filename)
   , m_idxFrameStep(0)
   , m_numFrames(0)
   , m_numFrameRetrieve(0)
+  , m_numThreads(0)
   , m_idxStream(-1)
   , m_width(0)
   , m_height(0)
+  , m_thumbWidth(0)
+  , m_thumbHeight(0)
   , m_fps(0)
   , m_isOpen(false)
   , m_isFrameFinished(false)
+  , m_isKeyFramesOnly(false)
+  , m_isFastDecode(false)
   , m_filename(filename) {}
 
 MediaContext::~MediaContext() {
   Close();
+  FreeBuffers();
+  FreeThumbnailBuffers();
+}
+
+int MediaContext::GetScaleFlags() const {
+  return m_isFastDecode ? SWS_FAST_BILINEAR : SWS_BICUBIC;
 }
 
 int MediaContext::GetNumberVideoFrames() const {
@@ -123,6 +158,13 @@ bool MediaContext::Open() {
 
 bool MediaContext::IsOpen() const { return m_isOpen; }
 
+bool MediaContext::Reopen(const char* filename) {
+  Close();
+  m_filename = filename;
+
+  return Open();
+}
+
 bool MediaContext::OpenStream(StreamType type, int index) {
   if(!IsOpen()) {
     // Open context if not already
@@ -167,9 +209,30 @@ bool MediaContext::OpenStream(StreamType type, int index) {
       if((err = avcodec_copy_context(m_pCodecCtx, m_pStream->codec)) < 0) {
         print_error("Failed to copy codec context: ", err);
         m_pCodec = nullptr;
-      } else if(avcodec_open2(m_pCodecCtx, m_pCodec, nullptr) < 0) {
-        //LOG_ERROR("Failed to open codec");
-        m_pCodec = nullptr;
+      } else {
+        // Decode with frame and slice threading, on one thread per core unless set otherwise
+        m_pCodecCtx->thread_count = m_numThreads;
+        m_pCodecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+        // The decoder drops the other frames without decoding them, each key frame is a sample
+        if(m_isKeyFramesOnly)
+          m_pCodecCtx->skip_frame = AVDISCARD_NONKEY;
+
+        // Frames end up as 64 bin histograms and 32x32 thumbnails, so decode them at a lower
+        // resolution where the codec can, and skip the steps that only refine details
+        if(m_isFastDecode) {
+          auto lowres = av_codec_get_max_lowres(m_pCodec);
+          if(lowres > MAX_LOWRES)
+            lowres = MAX_LOWRES;
+          m_pCodecCtx->lowres = lowres;
+          m_pCodecCtx->skip_loop_filter = AVDISCARD_ALL;
+          m_pCodecCtx->skip_idct = AVDISCARD_BIDIR;
+          m_pCodecCtx->flags2 |= CODEC_FLAG2_FAST;
+        }
+        if(avcodec_open2(m_pCodecCtx, m_pCodec, nullptr) < 0) {
+          //LOG_ERROR("Failed to open codec");
+          m_pCodec = nullptr;
+        }
       }
 
       if(m_pCodec != nullptr) {
@@ -221,7 +284,9 @@ bool MediaContext::IsStreamIndex(int index) const {
 }
 
 bool MediaContext::CloseStream() {
-  FreeBuffers();
+  // Buffers are kept for the next stream, the frame must not refer to the decoder's though
+  if(m_pFrameSrc != nullptr)
+    av_frame_unref(m_pFrameSrc);
 
   if(m_pCodecCtx != nullptr) {
     avcodec_close(m_pCodecCtx);
@@ -236,6 +301,9 @@ bool MediaContext::CloseStream() {
   m_fps = 0;
   m_width = 0;
   m_height = 0;
+  m_idxFrameCur = 0;
+  m_idxFrameNext = 0;
+  m_isFrameFinished = false;
 
   return true;
 }
@@ -258,37 +326,72 @@ bool MediaContext::Close() {
 }
 
 bool MediaContext::SetDimensions(int width, int height) {
-  FreeBuffers();
-
   m_width = width;
   m_height = height;
 
   return AllocateBuffers();
 }
 
-bool MediaContext::AllocateBuffers() {
-  m_pFrameDst = nullptr;
-  m_pBuffer = nullptr;
-  m_pSwsContext = nullptr;
+bool MediaContext::SetThumbnailDimensions(int width, int height) {
+  if(m_pCodecCtx == nullptr) {
+    return false;
+  }
 
-  m_pFrameSrc = av_frame_alloc();
+  m_thumbWidth = width;
+  m_thumbHeight = height;
+
+  // Second scaler from the decoded frame, so a thumbnail can be read along with each frame.
+  // The frame, buffer and scaler of the previous stream are reused when they fit.
+  auto success = false;
+  if(m_pFrameThumb == nullptr)
+    m_pFrameThumb = av_frame_alloc();
+  if(m_pFrameThumb != nullptr) {
+    auto numBytes = avpicture_get_size(m_pixelFormat, m_thumbWidth, m_thumbHeight);
+    if(numBytes > m_thumbBufferSize) {
+      av_free(m_pThumbBuffer);
+      m_pThumbBuffer = static_cast<uint8_t *>(av_malloc(numBytes * sizeof(uint8_t)));
+      m_thumbBufferSize = (m_pThumbBuffer != nullptr) ? numBytes : 0;
+    }
+    if(m_pThumbBuffer != nullptr) {
+      avpicture_fill(reinterpret_cast<AVPicture *>(m_pFrameThumb), m_pThumbBuffer, m_pixelFormat, m_thumbWidth, m_thumbHeight);
+      m_pThumbSwsContext = sws_getCachedContext(m_pThumbSwsContext, m_pCodecCtx->width, m_pCodecCtx->height, m_pCodecCtx->pix_fmt, m_thumbWidth, m_thumbHeight, m_pixelFormat, GetScaleFlags(), nullptr, nullptr, nullptr);
+      success = m_pThumbSwsContext != nullptr;
+    }
+  }
+
+  if(!success) {
+    FreeThumbnailBuffers();
+  }
+
+  return success;
+}
+
+bool MediaContext::AllocateBuffers() {
+  // Frames, buffer and scaler of the previous stream or file are reused when they fit
+  if(m_pFrameSrc == nullptr)
+    m_pFrameSrc = av_frame_alloc();
   if(m_pFrameSrc == nullptr) {
     return false;
   }
 
   bool success;
-  m_pFrameDst = av_frame_alloc();
+  if(m_pFrameDst == nullptr)
+    m_pFrameDst = av_frame_alloc();
   if(m_pFrameDst == nullptr) {
     success = false;
   } else {
-    // Determine required buffer size and allocate buffer
+    // Determine required buffer size and allocate buffer if the current one is too small
     auto numBytes = avpicture_get_size(m_pixelFormat, m_width, m_height);
-    m_pBuffer = static_cast<uint8_t *>(av_malloc(numBytes * sizeof(uint8_t)));
+    if(numBytes > m_bufferSize) {
+      av_free(m_pBuffer);
+      m_pBuffer = static_cast<uint8_t *>(av_malloc(numBytes * sizeof(uint8_t)));
+      m_bufferSize = (m_pBuffer != nullptr) ? numBytes : 0;
+    }
     if(m_pBuffer == nullptr) {
       success = false;
     } else {
       avpicture_fill(reinterpret_cast<AVPicture *>(m_pFrameDst), m_pBuffer, m_pixelFormat, m_width, m_height);
-      m_pSwsContext = sws_getContext(m_pCodecCtx->width, m_pCodecCtx->height, m_pCodecCtx->pix_fmt, m_width, m_height, m_pixelFormat, SWS_BICUBIC, nullptr, nullptr, nullptr);
+      m_pSwsContext = sws_getCachedContext(m_pSwsContext, m_pCodecCtx->width, m_pCodecCtx->height, m_pCodecCtx->pix_fmt, m_width, m_height, m_pixelFormat, GetScaleFlags(), nullptr, nullptr, nullptr);
       success = m_pSwsContext != nullptr;
     }
   }
@@ -320,12 +423,23 @@ bool MediaContext::DecodeVideoFrame(const AVPacket& packet) {
   return true;
 }
 
+bool MediaContext::FlushVideoFrame() {
+  AVPacket avpkt;
+
+  // An empty packet returns the frames the decoder held back, e.g. on its other threads
+  av_init_packet(&avpkt);
+  avpkt.data = nullptr;
+  avpkt.size = 0;
+
+  return DecodeVideoFrame(avpkt);
+}
+
 bool MediaContext::IsDecodeVideoFinished() const {
   return m_isFrameFinished;
 }
 
 bool MediaContext::IsNextFrameIndex() const {
-  return (m_idxFrameCur - 1) == m_idxFrameNext;
+  return m_isKeyFramesOnly || ((m_idxFrameCur - 1) == m_idxFrameNext);
 }
 
 void MediaContext::StepNextFrameIndex() {
@@ -354,14 +468,40 @@ bool MediaContext::ReadCurrentFrame(CImageI& image) const {
   if(!m_isFrameFinished)
     return false;
 
-  sws_scale(m_pSwsContext, m_pFrameSrc->data, m_pFrameSrc->linesize, 0, m_pCodecCtx->height, m_pFrameDst->data, m_pFrameDst->linesize);
+  ScaleCurrentFrame(m_pSwsContext, m_pFrameDst, m_width, m_height, image);
 
-  auto channels = (m_pixelFormat == AV_PIX_FMT_GRAY8) ? 1 : 3;
-  image.assign(*m_pFrameDst->data, channels, m_width, m_height, 1, true);
+  return true;
+}
+
+bool MediaContext::ReadCurrentThumbnail(CImageI& image) const {
+  if(!m_isFrameFinished || m_pThumbSwsContext == nullptr)
+    return false;
+
+  ScaleCurrentFrame(m_pThumbSwsContext, m_pFrameThumb, m_thumbWidth, m_thumbHeight, image);
 
   return true;
 }
 
+void MediaContext::ScaleCurrentFrame(SwsContext* pSwsContext, AVFrame* pFrameDst, int width, int height, CImageI& image) const {
+  auto channels = (m_pixelFormat == AV_PIX_FMT_GRAY8) ? 1 : 3;
+
+  // Image laid out as CImg planes (width x height x 1 x channels), its memory is kept when
+  // it already has these dimensions
+  image.assign(width, height, 1, channels);
+
+  if(channels == 1) {
+    // A single plane is laid out the same way by swscale, scale straight into the image
+    uint8_t* data[4] = { image.data(), nullptr, nullptr, nullptr };
+    int linesize[4] = { width, 0, 0, 0 };
+    sws_scale(pSwsContext, m_pFrameSrc->data, m_pFrameSrc->linesize, 0, m_pCodecCtx->height, data, linesize);
+  } else {
+    // Interleaved channels are scaled into the frame buffer, then split into planes
+    sws_scale(pSwsContext, m_pFrameSrc->data, m_pFrameSrc->linesize, 0, m_pCodecCtx->height, pFrameDst->data, pFrameDst->linesize);
+    const CImageI packed(*pFrameDst->data, channels, width, height, 1, true);
+    image = packed.get_permute_axes("yzcx");
+  }
+}
+
 bool MediaContext::FreeBuffers() {
   if(m_pFrameSrc != nullptr)
     av_frame_free(&m_pFrameSrc);
@@ -376,6 +516,25 @@ bool MediaContext::FreeBuffers() {
   m_pFrameDst = nullptr;
   m_pBuffer = nullptr;
   m_pSwsContext = nullptr;
+  m_bufferSize = 0;
+
+  return true;
+}
+
+bool MediaContext::FreeThumbnailBuffers() {
+  if(m_pFrameThumb != nullptr)
+    av_frame_free(&m_pFrameThumb);
+  if(m_pThumbBuffer != nullptr)
+    av_free(m_pThumbBuffer);
+  if(m_pThumbSwsContext != nullptr)
+    sws_freeContext(m_pThumbSwsContext);
+
+  m_pFrameThumb = nullptr;
+  m_pThumbBuffer = nullptr;
+  m_pThumbSwsContext = nullptr;
+  m_thumbBufferSize = 0;
+  m_thumbWidth = 0;
+  m_thumbHeight = 0;
 
   return true;
 }
@@ -0,0 +1,66 @@
+#include "internal.h"
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int numThreads, int maxQueued)
+ : m_maxQueued { 0 },
+   m_stop { false } {
+#ifdef HAVE_PTHREAD
+  if(numThreads <= 0)
+    numThreads = GetNumCores();
+  if(numThreads > 1) {
+    m_maxQueued = (maxQueued > 0) ? maxQueued : 2 * numThreads;
+    for(auto i = 0; i < numThreads; i++) {
+      m_threads.emplace_back(&ThreadPool::Run, this);
+    }
+  }
+#else
+  (void)numThreads;
+  (void)maxQueued;
+#endif
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+
+  m_notEmpty.notify_all();
+  for(auto& thread : m_threads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Push(std::function<void()> task) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_notFull.wait(lock, [this] { return m_tasks.size() < m_maxQueued; });
+  m_tasks.push_back(std::move(task));
+  lock.unlock();
+
+  m_notEmpty.notify_one();
+}
+
+void ThreadPool::Run() {
+  for(;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_notEmpty.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+
+      // Queued tasks are run before stopping, their futures may still be waited on
+      if(m_tasks.empty())
+        return;
+
+      task = std::move(m_tasks.front());
+      m_tasks.pop_front();
+    }
+
+    m_notFull.notify_one();
+    task();
+  }
+}
+
+int ThreadPool::GetNumCores() {
+  auto cores = static_cast<int>(std::thread::hardware_concurrency());
+  return (cores > 0) ? cores : 1;
+}
@@ -1,6 +1,10 @@
 
 #include "VideoProcessor.h"
+#include <array>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <vector>
 
 int ReadFrames(MediaContextPtr pContext, CImageIListPtr pFrameList, uint64_t idxLow, uint64_t idxHigh) {
   pContext->SetIndexNextFrame(idxLow);
@@ -20,7 +24,6 @@ int ReadFrames(MediaContextPtr pContext, CImageIListPtr pFrameList, uint64_t idx
       if(success && pContext->IsDecodeVideoFinished() && pContext->IsNextFrameIndex()) {
         pContext->StepNextFrameIndex();
         pContext->ReadCurrentFrame(image);
-        image.permute_axes("yzcx");
         pFrameList->push_back(image);
 
         frameNo++;
@@ -33,213 +36,329 @@ int ReadFrames(MediaContextPtr pContext, CImageIListPtr pFrameList, uint64_t idx
   return success ? frameNo : -1;
 }
 
-int VideoProcessor::ReadFrames(CImageIListPtr pFrameList) const {
-  AVPacket packet;
-  CImageI image;
-  auto frameNo = 0;
-  auto success = true;
+// Bin of each 8-bit value in CImg's get_histogram(64, 0, 255), whose hashes are kept
+static const std::array<uint8_t, 256> HistogramBins = [] {
+  std::array<uint8_t, 256> bins;
+  for(auto v = 0; v < 256; v++) {
+    bins[v] = static_cast<uint8_t>((v == 255) ? 63 : (v * 64) / 255);
+  }
 
-  while(success && frameNo < m_pContext->GetNumRetrieveFrames()) {
-    if(av_read_frame(m_pContext->GetFormatContext(), &packet) < 0)
-      break;
+  return bins;
+}();
 
-    if(m_pContext->IsStreamIndex(packet.stream_index)) {
-      success = m_pContext->DecodeVideoFrame(packet);
-      if(success && m_pContext->IsDecodeVideoFinished() && m_pContext->IsNextFrameIndex()) {
-        m_pContext->StepNextFrameIndex();
-        m_pContext->ReadCurrentFrame(image);
-        image.permute_axes("yzcx");
-        pFrameList->push_back(image);
-        frameNo++;
+FrameArena::FrameArena()
+ : m_pPool { std::make_shared<Pool>() } {
+}
+
+CImageIPtr FrameArena::Acquire() {
+  std::unique_ptr<CImageI> pImage;
+  {
+    std::lock_guard<std::mutex> lock(m_pPool->mutex);
+    if(!m_pPool->images.empty()) {
+      pImage = std::move(m_pPool->images.back());
+      m_pPool->images.pop_back();
+    }
+  }
+
+  if(pImage == nullptr)
+    pImage.reset(new CImageI());
+
+  // The deleter holds on to the pool, so images released after the arena are still recycled
+  auto pPool = m_pPool;
+  return CImageIPtr(pImage.release(), [pPool](CImageI* p) {
+    std::lock_guard<std::mutex> lock(pPool->mutex);
+    pPool->images.emplace_back(p);
+  });
+}
+
+int VideoProcessor::ReadFrame(CImageI& frame, CImageI& thumb) const {
+  AVPacket packet;
+  auto result = 0;
+
+  while(result == 0) {
+    auto isPacketRead = av_read_frame(m_pContext->GetFormatContext(), &packet) >= 0;
+    auto isFrameDecoded = false;
+
+    if(!isPacketRead) {
+      // End of stream, drain the frames held back by the decoder threads
+      if(!m_pContext->FlushVideoFrame() || !m_pContext->IsDecodeVideoFinished())
+        break;
+      isFrameDecoded = true;
+    } else if(m_pContext->IsStreamIndex(packet.stream_index)) {
+      if(!m_pContext->DecodeVideoFrame(packet)) {
+        result = -1;
+      } else {
+        isFrameDecoded = m_pContext->IsDecodeVideoFinished();
       }
     }
 
-    av_free_packet(&packet);
+    if(isFrameDecoded && m_pContext->IsNextFrameIndex()) {
+      m_pContext->StepNextFrameIndex();
+      m_pContext->ReadCurrentFrame(frame);
+      m_pContext->ReadCurrentThumbnail(thumb);
+      result = 1;
+    }
+
+    if(isPacketRead)
+      av_free_packet(&packet);
   }
 
-  return success ? frameNo : -1;
+  return result;
 }
 
-bool VideoProcessor::CalculateFrameDifferential(float* pFrameDist) const {
-  auto numTotalFrames = m_pContext->GetNumFrames();
+bool VideoProcessor::DetectSceneChanges(const KeyframeCallback& onKeyframe, ThreadPool& pool) const {
   auto idxCurFrame = 0;
-  auto pFrameList = std::make_shared<CImageIList>();
 
-  CImageF prev(64, 1, 1, 1, 0);
-  int numFrames;
+  // Frames and thumbnails are scaled straight into images recycled by the arenas
+  FrameArena frames;
+  FrameArena thumbnails;
+
+  Histogram prev {};
+
+  // Only the frames within reach of the frames not settled yet are kept, so the memory used
+  // does not depend on the length of the video. A frame is settled once the L frames after
+  // it are read: its differences ring holds the +/-L frames around it, and the thumbnails
+  // ring the frames since, from which the keyframe of its segment is picked.
+  std::vector<float> diffs(DIFF_RING);
+  std::vector<CImageIPtr> thumbs(L + 1);
+  BoundryDetector detector(diffs.data());
+
+  // Frame of least difference since the last boundary, with its difference and thumbnail
+  auto idxMin = -1;
+  auto minDiff = 0.0f;
+  CImageIPtr pKeyframe;
+
+  auto settle = [&](int idxFrame, int numFramesRead) -> bool {
+    auto& pThumb = thumbs[idxFrame % (L + 1)];
+    auto diff = diffs[idxFrame % DIFF_RING];
+    if(idxFrame == 0) {
+      // First frame is always a boundary
+      if(numFramesRead == 1)
+        return onKeyframe(*pThumb);
+    } else if((idxFrame == numFramesRead - 1) || detector.IsBoundryFrame(idxFrame, numFramesRead)) {
+      // Segment closed, with the boundary itself as keyframe if there is no frame within it
+      auto result = onKeyframe((idxMin < 0) ? *pThumb : *pKeyframe);
+      idxMin = -1;
+      pKeyframe = nullptr;
+      return result;
+    } else if((idxMin < 0) || (diff < minDiff)) {
+      idxMin = idxFrame;
+      minDiff = diff;
+      pKeyframe = pThumb;
+    }
 
-  m_pContext->SetNumRetrieveFrames(100);
+    return true;
+  };
+
+  // Histograms are computed by the workers while the next frames are decoded, and used
+  // in the order of the frames
+  struct PendingFrame {
+    std::future<Histogram> hist;
+    CImageIPtr pThumb;
+  };
+  std::deque<PendingFrame> pending;
+  const auto maxPending = 2 * pool.GetNumThreads();
+
+  // Calculate threshold difference between the next frame and the previous one
+  auto process = [&]() -> bool {
+    auto& frame = pending.front();
+    auto hist = frame.hist.get();
+    thumbs[idxCurFrame % (L + 1)] = std::move(frame.pThumb);
+    pending.pop_front();
+
+    diffs[idxCurFrame % DIFF_RING] = CalculateHistogramDifference(hist, prev);
+    prev = hist;
+
+    auto result = (idxCurFrame < L) || settle(idxCurFrame - L, idxCurFrame + 1);
+    idxCurFrame++;
+
+    return result;
+  };
 
-  // Calculate threshold difference between each successive frame
-  do {
-    numFrames = ReadFrames(pFrameList);
-    if(numFrames < 0) {
+  for(;;) {
+    auto pFrame = frames.Acquire();
+    auto pThumb = thumbnails.Acquire();
+    auto result = ReadFrame(*pFrame, *pThumb);
+    if(result < 0) {
       return false;
+    } else if(result == 0) {
+      break;
     }
 
-    unsigned int i = 0;
-    while((i < pFrameList->size()) && (idxCurFrame < numTotalFrames)) {
-      auto current = pFrameList->at(i++);
-      auto hist = current.get_histogram(64, 0, 255);
-
-      pFrameDist[idxCurFrame] = 0.0;
-      cimg_forX(hist, X) {
-        auto d = hist(X) - prev(X);
-        d = (d >= 0) ? d : -d;
-        pFrameDist[idxCurFrame] += d;
-        prev(X) = static_cast<float>(hist(X));
-      }
-
-      idxCurFrame++;
+    PendingFrame frame;
+    frame.hist = pool.Submit([pFrame] {
+      Histogram hist;
+      CalculateHistogram(*pFrame, hist);
+      return hist;
+    });
+    frame.pThumb = std::move(pThumb);
+    pending.push_back(std::move(frame));
+
+    while(static_cast<int>(pending.size()) > maxPending) {
+      if(!process())
+        return true;
     }
+  }
+
+  while(!pending.empty()) {
+    if(!process())
+      return true;
+  }
 
-    pFrameList->clear();
-  } while((numFrames >= m_pContext->GetNumRetrieveFrames()) && (idxCurFrame < numTotalFrames));
+  // Settle the last frames, now that the number of frames is known
+  for(auto i = (idxCurFrame > L) ? idxCurFrame - L : 0; i < idxCurFrame; i++) {
+    if(!settle(i, idxCurFrame))
+      break;
+  }
 
   return true;
 }
 
-std::vector<uint64_t> VideoProcessor::CalculateBoundryFrames(float* pFrameDiff) const {
-  auto numFrames = m_pContext->GetNumFrames();
-  auto pBounds = new uint8_t[numFrames];
-  const auto S = 10;
-  const auto L = 50;
-  auto alpha1 = 3;
-  auto alpha2 = 2;
-  int s_begin, s_end;
-  int l_begin, l_end;
-  auto idxCurFrame = 1;
-
-  pBounds[0] = 1;
-
-  do {
-    l_begin = (idxCurFrame - L >= 0) ? idxCurFrame - L : 0;
-    l_end = (idxCurFrame + L < numFrames) ? idxCurFrame + L : numFrames - 1;
-
-    /* get global average */
-    float ave_global;
-    float sum_global = 0.0;
-    float dev_global = 0.0;
-    for(auto i = l_begin; i <= l_end; i++) {
-      sum_global += pFrameDiff[i];
-    }
+void VideoProcessor::CalculateHistogram(const CImageI& frame, Histogram& hist) {
+  // Values are counted in four separate tables, so that runs of a same value, common in
+  // flat areas, do not wait on the increments of a single counter
+  uint32_t counts[4][256] = {};
+  auto pData = frame.data();
+  auto size = static_cast<size_t>(frame.size());
+
+  size_t i = 0;
+  for(; i + 4 <= size; i += 4) {
+    counts[0][pData[i]]++;
+    counts[1][pData[i + 1]]++;
+    counts[2][pData[i + 2]]++;
+    counts[3][pData[i + 3]]++;
+  }
 
-    ave_global = sum_global / static_cast<float>(l_end - l_begin + 1);
+  for(; i < size; i++) {
+    counts[0][pData[i]]++;
+  }
 
-    /*get global deviation */
-    for(auto i = l_begin; i <= l_end; i++) {
-      auto dev = ave_global - pFrameDiff[i];
-      dev = (dev >= 0) ? dev : -1 * dev;
-      dev_global += dev;
-    }
+  hist.fill(0);
+  for(auto v = 0; v < 256; v++) {
+    hist[HistogramBins[v]] += counts[0][v] + counts[1][v] + counts[2][v] + counts[3][v];
+  }
+}
 
-    dev_global = dev_global / static_cast<float>(l_end - l_begin + 1);
+float VideoProcessor::CalculateHistogramDifference(const Histogram& hist, const Histogram& prev) {
+  uint64_t sum = 0;
+  for(size_t i = 0; i < hist.size(); i++) {
+    sum += (hist[i] >= prev[i]) ? hist[i] - prev[i] : prev[i] - hist[i];
+  }
 
-    s_begin = (idxCurFrame - S >= 0) ? idxCurFrame - S : 0;
-    s_end = (idxCurFrame + S < numFrames) ? idxCurFrame + S : numFrames - 1;
+  return static_cast<float>(sum);
+}
 
-    /* get local maximum */
-    auto localmaxpos = s_begin;
-    for(auto i = s_begin; i <= s_end; i++) {
-      if(pFrameDiff[i] > pFrameDiff[localmaxpos])
-        localmaxpos = i;
-    }
+VideoProcessor::BoundryDetector::BoundryDetector(const float* pFrameDiff)
+ : m_pFrameDiff { pFrameDiff },
+   m_idxNext { 0 } {
+}
 
-    /* get 2nd local maximum */
-    auto localmaxpos2 = s_begin;
-    auto localmax2 = 0.0f;
-    for(auto i = s_begin; i <= s_end; i++) {
-      if(i == localmaxpos)
-        continue;
-      if(pFrameDiff[i] > localmax2) {
-        localmaxpos2 = i;
-        localmax2 = pFrameDiff[i];
-      }
-    }
+bool VideoProcessor::BoundryDetector::IsBoundryFrame(int idxFrame, int numFrames) {
+  const auto alpha1 = 3;
+  const auto alpha2 = 2;
 
-    auto t_global = ave_global + alpha1*dev_global;
-    auto t_local = alpha2*pBounds[localmaxpos2];
-    auto thresh = (t_global >= t_local) ? t_global : t_local;
-    if((pBounds[idxCurFrame] == pBounds[localmaxpos]) && (pBounds[idxCurFrame] > thresh)) {
-      pBounds[idxCurFrame] = 1;
-    } else {
-      pBounds[idxCurFrame] = 0;
-    }
+  auto pFrameDiff = m_pFrameDiff;
+  auto diff = [pFrameDiff](int i) { return pFrameDiff[i % DIFF_RING]; };
 
-    idxCurFrame++;
-  } while(idxCurFrame < numFrames - 1);
-
-  pBounds[numFrames - 1] = 1;
-
-  auto start = 0;
-  auto end = 0;
-  auto step = m_pContext->GetFrameStep();
-  std::vector<uint64_t> results;
-
-  do {
-    /* find next boundary */
-    do {
-      end++;
-    } while((pBounds[end] != 1) && (end < numFrames));
-
-    /* find min disparity within bounds */
-    auto minpos = start + 1;
-    for(auto i = start + 1; i < end; i++) {
-      if(pFrameDiff[i] < pFrameDiff[minpos])
-        minpos = i;
+  auto s_begin = (idxFrame - S >= 0) ? idxFrame - S : 0;
+  auto s_end = (idxFrame + S < numFrames) ? idxFrame + S : numFrames - 1;
+
+  /* slide the local window, keeping its maxima candidates in decreasing order */
+  for(; m_idxNext <= s_end; m_idxNext++) {
+    while(!m_maxima.empty() && (diff(m_maxima.back()) < diff(m_idxNext)))
+      m_maxima.pop_back();
+    m_maxima.push_back(m_idxNext);
+  }
+
+  while(m_maxima.front() < s_begin)
+    m_maxima.pop_front();
+
+  /* get local maximum, the first one of the window */
+  auto localmaxpos = m_maxima.front();
+  if(diff(idxFrame) != diff(localmaxpos))
+    return false;
+
+  /* get 2nd local maximum */
+  auto localmaxpos2 = s_begin;
+  auto localmax2 = 0.0f;
+  for(auto i = s_begin; i <= s_end; i++) {
+    if(i == localmaxpos)
+      continue;
+    if(diff(i) > localmax2) {
+      localmaxpos2 = i;
+      localmax2 = diff(i);
     }
+  }
 
-    results.push_back(minpos*step);
+  auto t_local = alpha2*diff(localmaxpos2);
+  if(!(diff(idxFrame) > t_local))
+    return false;
 
-    start = end;
-  } while(start < numFrames - 1);
+  auto l_begin = (idxFrame - L >= 0) ? idxFrame - L : 0;
+  auto l_end = (idxFrame + L < numFrames) ? idxFrame + L : numFrames - 1;
 
-  delete[] pBounds;
+  /* get global average */
+  float ave_global;
+  float sum_global = 0.0;
+  float dev_global = 0.0;
+  for(auto i = l_begin; i <= l_end; i++) {
+    sum_global += diff(i);
+  }
 
-  return results;
+  ave_global = sum_global / static_cast<float>(l_end - l_begin + 1);
+
+  /*get global deviation */
+  for(auto i = l_begin; i <= l_end; i++) {
+    auto dev = ave_global - diff(i);
+    dev = (dev >= 0) ? dev : -1 * dev;
+    dev_global += dev;
+  }
+
+  dev_global = dev_global / static_cast<float>(l_end - l_begin + 1);
+
+  auto t_global = ave_global + alpha1*dev_global;
+
+  return diff(idxFrame) > t_global;
 }
 
 VideoProcessor::VideoProcessor(MediaContextPtr pContext)
  : m_pContext { pContext } {
 }
 
-CImageIListPtr VideoProcessor::GetSceneChangeFrames(const char* filename) {
-  auto pContext = MediaContext::Create(filename);
+bool VideoProcessor::GetSceneChangeFrames(const char* filename, const KeyframeCallback& onKeyframe, const DecodeOptions& options, ThreadPool* pPool) {
+  auto pContext = MediaContext::Acquire(filename);
   if(pContext == nullptr)
-    return nullptr;
-  if(!pContext->Open()) 
-    return nullptr;
-  if(!pContext->OpenStream(StreamType::Video, 0))
-    return nullptr;
-
-  auto numFrames = pContext->GetNumFrames();
-  auto pFrameDist = new float[numFrames];
-  auto pFrameList = std::make_shared<CImageIList>();
-  auto success = true;
-
-  VideoProcessor processor(pContext);
-  if (!processor.CalculateFrameDifferential(pFrameDist)) {
-    success = false;
-  } else {
-    auto boundries = processor.CalculateBoundryFrames(pFrameDist);
-
-    pContext->SetNumRetrieveFrames(1);
-    if (!pContext->SetDimensions(32, 32)) {
-      success = false;
+    return false;
+
+  pContext->SetKeyFramesOnly(options.keyFramesOnly);
+  pContext->SetFastDecode(options.fastDecode);
+  pContext->SetNumThreads(options.numThreads);
+
+  // Keyframes are scaled down along with the frames read for the histograms
+  auto success = pContext->OpenStream(StreamType::Video, 0) && pContext->SetThumbnailDimensions(THUMB_SIZE, THUMB_SIZE);
+  if(success) {
+    VideoProcessor processor(pContext);
+    if(pPool != nullptr) {
+      success = processor.DetectSceneChanges(onKeyframe, *pPool);
     } else {
-      pContext->Reset();
-      for(auto& index : boundries) {
-        pContext->SetIndexNextFrame(index);
-        if(processor.ReadFrames(pFrameList) < 0) {
-          success = false;
-          break;
-        }
-      }
+      ThreadPool pool;
+      success = processor.DetectSceneChanges(onKeyframe, pool);
     }
   }
 
-  delete[] pFrameDist;
-    
+  // The file is closed, the buffers are kept for the next one read on this thread
+  pContext->Close();
+
+  return success;
+}
+
+CImageIListPtr VideoProcessor::GetSceneChangeFrames(const char* filename) {
+  auto pFrameList = std::make_shared<CImageIList>();
+  auto success = GetSceneChangeFrames(filename, [&](const CImageI& keyframe) {
+    pFrameList->push_back(keyframe);
+    return true;
+  });
+
   return success ? pFrameList : nullptr;
 }
 
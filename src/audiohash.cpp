@@ -26,11 +26,21 @@
 #if HAVE_AUDIO_HASH
 
 #include "audiohash.h"
+#include "resampler.h"
 //#include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <cmath>
 #include <algorithm>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
 #include <sndfile.h.in>
-#include <samplerate.h>
 
 #if defined(HAVE_PTHREAD)
 #include <pthread.h>
@@ -41,9 +51,8 @@
 #endif /* Def WIN32 or Def WIN64 */
 #include "phash.h"
 
-extern "C" {
 #include "fft.h"
-}
+#include "ThreadPool.h"
 
 #if HAVE_LIBMPG123
 #include <mpg123.h.in>
@@ -61,277 +70,477 @@ int ph_count_samples(const char *filename, int sr, int channels) {
   return count;
 }
 
+namespace {
+
+/* Source of the samples of an audio file, averaged over its channels, read block by block */
+class AudioReader {
+public:
+  AudioReader()
+    : m_sr{ 0 }
+    , m_length{ -1 } {}
+
+  virtual ~AudioReader() {}
+
+  long GetSampleRate() const { return m_sr; }
+
+  // Number of samples in the file, negative if unknown
+  long GetLength() const { return m_length; }
+
+  // Reads up to count samples into buf. Returns the number read, 0 at the end of the file,
+  // negative for error.
+  virtual int Read(float *buf, int count) = 0;
+
+  // Moves to sample pos, the next read starting there. Returns false for error.
+  virtual bool Seek(long pos) = 0;
+
+protected:
+  long m_sr;
+  long m_length;
+};
+
 #if HAVE_LIBMPG123
 
-static float* readaudio_mp3(const char *filename, long *sr, const float nbsecs, unsigned int *buflen) {
-  mpg123_handle *m;
-  int ret;
+/* mpg123 handle kept by each thread for the files it decodes one after another */
+struct Mpg123Cache {
+  Mpg123Cache()
+    : handle{ nullptr }
+    , busy{ false } {}
 
-  if (mpg123_init() != MPG123_OK || ((m = mpg123_new(nullptr, &ret)) == nullptr) || \
-    mpg123_open(m, filename) != MPG123_OK) {
-    fprintf(stderr, "unable to init mpg\n");
-    return nullptr;
+  ~Mpg123Cache() {
+    if (handle != nullptr) {
+      mpg123_delete(handle);
+    }
   }
 
-  /*turn off logging */
-  mpg123_param(m, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+  mpg123_handle* handle;
+  bool           busy;
+};
+
+class Mp3Reader : public AudioReader {
+public:
+  Mp3Reader()
+    : m_handle{ nullptr }
+    , m_cached{ false }
+    , m_open{ false }
+    , m_channels{ 0 }
+    , m_encoding{ 0 }
+    , m_sampleSize{ 0 } {}
+
+  ~Mp3Reader() {
+    if (m_open) {
+      mpg123_close(m_handle);
+    }
+    if (m_cached) {
+      GetCache().busy = false;
+    } else if (m_handle != nullptr) {
+      mpg123_delete(m_handle);
+    }
+  }
 
-  off_t totalsamples;
+  bool Open(const char *filename) {
+    static std::once_flag init_flag;
+    static bool init = false;
+    std::call_once(init_flag, [] { init = (mpg123_init() == MPG123_OK); });
 
-  mpg123_scan(m);
-  totalsamples = mpg123_length(m);
+    /* the thread's handle, unless another reader of the thread holds it */
+    Mpg123Cache& cache = GetCache();
+    if (init && !cache.busy) {
+      if (cache.handle == nullptr) {
+        cache.handle = NewHandle();
+      }
+      m_handle = cache.handle;
+      m_cached = (m_handle != nullptr);
+      cache.busy = m_cached;
+    } else if (init) {
+      m_handle = NewHandle();
+    }
 
- // int meta = mpg123_meta_check(m);
-  int channels, encoding;
+    if (m_handle == nullptr) {
+      fprintf(stderr, "unable to init mpg\n");
+      return false;
+    }
 
-  if (mpg123_getformat(m, sr, &channels, &encoding) != MPG123_OK) {
-    fprintf(stderr, "unable to get format\n");
-    return nullptr;
-  }
+    /* formats are locked to the ones of the previous file */
+    mpg123_format_all(m_handle);
+    if (mpg123_open(m_handle, filename) != MPG123_OK) {
+      fprintf(stderr, "unable to init mpg\n");
+      return false;
+    }
+    m_open = true;
 
-  mpg123_format_none(m);
-  mpg123_format(m, *sr, channels, encoding);
+    /* estimated from the headers, without the pass over the whole file of mpg123_scan */
+    off_t length = mpg123_length(m_handle);
+    m_length = (length > 0) ? (long)length : -1;
 
-  size_t decbuflen = mpg123_outblock(m);
-  unsigned char *decbuf = (unsigned char*)malloc(decbuflen);
-  if (decbuf == nullptr) {
-    printf("mem alloc error\n");
-    return nullptr;
-  }
+    if (mpg123_getformat(m_handle, &m_sr, &m_channels, &m_encoding) != MPG123_OK) {
+      fprintf(stderr, "unable to get format\n");
+      return false;
+    }
 
-  unsigned int nbsamples = (nbsecs <= 0) ? totalsamples : nbsecs*(*sr);
-  nbsamples = (nbsamples < totalsamples) ? nbsamples : totalsamples;
+    switch (m_encoding) {
+    case MPG123_ENC_SIGNED_16:
+      m_sampleSize = sizeof(short);
+      break;
+    case MPG123_ENC_SIGNED_8:
+      m_sampleSize = sizeof(char);
+      break;
+    case MPG123_ENC_FLOAT_32:
+      m_sampleSize = sizeof(float);
+      break;
+    default:
+      fprintf(stderr, "unsupported encoding\n");
+      return false;
+    }
 
-  size_t i, j, index = 0, done;
+    mpg123_format_none(m_handle);
+    mpg123_format(m_handle, m_sr, m_channels, m_encoding);
 
-  float *buffer = (float*)malloc(nbsamples*sizeof(float));
-  *buflen = nbsamples;
+    return true;
+  }
+
+  int Read(float *buf, int count) override {
+    size_t i, j, index = 0, done;
+
+    m_decbuf.resize(count*m_channels*m_sampleSize);
+    int ret = mpg123_read(m_handle, m_decbuf.data(), m_decbuf.size(), &done);
+    if (done == 0) {
+      return (ret == MPG123_OK || ret == MPG123_DONE) ? 0 : -1;
+    }
 
-  do {
-    ret = mpg123_read(m, decbuf, decbuflen, &done);
-    switch (encoding) {
+    switch (m_encoding) {
     case MPG123_ENC_SIGNED_16:
-      for (i = 0; i < done / sizeof(short); i += channels) {
-        buffer[index] = 0.0f;
-        for (j = 0; j < channels; j++) {
-          buffer[index] += (float)(((short*)decbuf)[i + j]) / (float)SHRT_MAX;
+      for (i = 0; i < done / sizeof(short); i += m_channels) {
+        buf[index] = 0.0f;
+        for (j = 0; j < m_channels; j++) {
+          buf[index] += (float)(((short*)m_decbuf.data())[i + j]) / (float)SHRT_MAX;
         }
-        buffer[index++] /= channels;
-        if (index >= nbsamples) break;
+        buf[index++] /= m_channels;
       }
       break;
     case MPG123_ENC_SIGNED_8:
-      for (i = 0; i < done / sizeof(char); i += channels) {
-        buffer[index] = 0.0f;
-        for (j = 0; j < channels; j++) {
-          buffer[index] += (float)(((char*)decbuf)[i + j]) / (float)SCHAR_MAX;
+      for (i = 0; i < done / sizeof(char); i += m_channels) {
+        buf[index] = 0.0f;
+        for (j = 0; j < m_channels; j++) {
+          buf[index] += (float)(((char*)m_decbuf.data())[i + j]) / (float)SCHAR_MAX;
         }
-        buffer[index++] /= channels;
-        if (index >= nbsamples) break;
+        buf[index++] /= m_channels;
       }
       break;
     case MPG123_ENC_FLOAT_32:
-      for (i = 0; i < done / sizeof(float); i += channels) {
-        buffer[index] = 0.0f;
-        for (j = 0; j < channels; j++) {
-          buffer[index] += ((float*)decbuf)[i + j];
+      for (i = 0; i < done / sizeof(float); i += m_channels) {
+        buf[index] = 0.0f;
+        for (j = 0; j < m_channels; j++) {
+          buf[index] += ((float*)m_decbuf.data())[i + j];
         }
-        buffer[index++] /= channels;
-        if (index >= nbsamples) break;
+        buf[index++] /= m_channels;
       }
       break;
-    default:
-      done = 0;
     }
-  } while (ret == MPG123_OK && index < nbsamples);
 
-  free(decbuf);
-  mpg123_close(m);
-  mpg123_delete(m);
-  mpg123_exit();
+    return (int)index;
+  }
 
-  return buffer;
-}
+  bool Seek(long pos) override {
+    return mpg123_seek(m_handle, (off_t)pos, SEEK_SET) >= 0;
+  }
 
-#endif /* HAVE_LIBMPG123 */
+private:
+  static Mpg123Cache& GetCache() {
+    static thread_local Mpg123Cache cache;
+    return cache;
+  }
 
-static float *readaudio_snd(const char *filename, long *sr, const float nbsecs, unsigned int *buflen) {
-  SF_INFO sf_info;
-  sf_info.format = 0;
-  SNDFILE *sndfile = sf_open(filename, SFM_READ, &sf_info);
-  if (sndfile == nullptr) {
-    return nullptr;
+  static mpg123_handle* NewHandle() {
+    int ret;
+    mpg123_handle *handle = mpg123_new(nullptr, &ret);
+    if (handle != nullptr) {
+      /*turn off logging */
+      mpg123_param(handle, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+    }
+    return handle;
   }
 
-  /* normalize */
-  sf_command(sndfile, SFC_SET_NORM_FLOAT, nullptr, SF_TRUE);
-  *sr = (long)sf_info.samplerate;
+  mpg123_handle*             m_handle;
+  bool                       m_cached;
+  bool                       m_open;
+  int                        m_channels;
+  int                        m_encoding;
+  int                        m_sampleSize;
+  std::vector<unsigned char> m_decbuf;
+};
 
-  //allocate input buffer for signal
-  unsigned int src_frames = (nbsecs <= 0) ? sf_info.frames : (nbsecs*sf_info.samplerate);
-  src_frames = (sf_info.frames < src_frames) ? sf_info.frames : src_frames;
-  float *inbuf = (float*)malloc(src_frames*sf_info.channels*sizeof(float));
+#endif /* HAVE_LIBMPG123 */
 
-  /*read frames */
-  sf_count_t cnt_frames = sf_readf_float(sndfile, inbuf, src_frames);
-  float *buf = (float*)malloc(cnt_frames*sizeof(float));
+class SndReader : public AudioReader {
+public:
+  SndReader()
+    : m_sndfile{ nullptr }
+    , m_channels{ 0 } {}
 
-  //average across all channels
-  int  i, j, indx = 0;
-  for (i = 0; i < cnt_frames*sf_info.channels; i += sf_info.channels) {
-    buf[indx] = 0;
+  ~SndReader() {
+    if (m_sndfile != nullptr) {
+      sf_close(m_sndfile);
+    }
+  }
 
-    for (j = 0; j < sf_info.channels; j++) {
-      buf[indx] += inbuf[i + j];
+  bool Open(const char *filename) {
+    SF_INFO sf_info;
+    sf_info.format = 0;
+    m_sndfile = sf_open(filename, SFM_READ, &sf_info);
+    if (m_sndfile == nullptr) {
+      return false;
     }
-    buf[indx++] /= sf_info.channels;
+
+    /* normalize */
+    sf_command(m_sndfile, SFC_SET_NORM_FLOAT, nullptr, SF_TRUE);
+    m_sr = (long)sf_info.samplerate;
+    m_length = (long)sf_info.frames;
+    m_channels = sf_info.channels;
+
+    return true;
   }
 
-  free(inbuf);
+  int Read(float *buf, int count) override {
+    if (m_channels == 1) {
+      return (int)sf_readf_float(m_sndfile, buf, count);
+    }
 
-  *buflen = indx;
+    m_block.resize(count*m_channels);
+    sf_count_t cnt_frames = sf_readf_float(m_sndfile, m_block.data(), count);
 
-  return buf;
-}
+    //average across all channels
+    int  i, j, indx = 0;
+    for (i = 0; i < cnt_frames*m_channels; i += m_channels) {
+      buf[indx] = 0;
 
-float* ph_readaudio2(const char *filename, int sr, float *sigbuf, int &buflen, const float nbsecs){
+      for (j = 0; j < m_channels; j++) {
+        buf[indx] += m_block[i + j];
+      }
+      buf[indx++] /= m_channels;
+    }
 
-  long orig_sr;
-  float *inbuffer;
-  unsigned int inbufferlength;
-  buflen = 0;
+    return indx;
+  }
+
+  bool Seek(long pos) override {
+    return sf_seek(m_sndfile, (sf_count_t)pos, SEEK_SET) >= 0;
+  }
+
+private:
+  SNDFILE*           m_sndfile;
+  int                m_channels;
+  std::vector<float> m_block;
+};
 
+std::unique_ptr<AudioReader> open_audio(const char *filename) {
   const char *suffix = strrchr(filename, '.');
   if (suffix == nullptr) return nullptr;
-  if (!strcasecmp(suffix+1, "mp3")) {
 #if HAVE_LIBMPG123
-    inbuffer = readaudio_mp3(filename, &orig_sr, nbsecs, &inbufferlength);
+  if (!strcasecmp(suffix+1, "mp3")) {
+    std::unique_ptr<Mp3Reader> reader(new Mp3Reader());
+    if (!reader->Open(filename)) return nullptr;
+    return std::move(reader);
+  }
 #endif /* HAVE_LIBMPG123 */
-  } else {
-    inbuffer = readaudio_snd(filename, &orig_sr, nbsecs, &inbufferlength);
-  }  
+  std::unique_ptr<SndReader> reader(new SndReader());
+  if (!reader->Open(filename)) return nullptr;
+  return std::move(reader);
+}
 
-  if (inbuffer == nullptr){
-    return nullptr;
-  }
+/* Reads maxlength samples from sample start, to the end of the file if maxlength is
+ * negative, resampled to sr */
+float* read_audio(AudioReader &reader, int sr, long start, long maxlength, const ph_resample_quality quality,
+                  float *sigbuf, int &buflen){
+  const int block_length = 4096;
+
+  /* caller's buffer, if any, until it is full */
+  float *outbuffer = (sigbuf != nullptr && buflen > 0) ? sigbuf : nullptr;
+  long outbufferlength = (outbuffer != nullptr) ? buflen : 0;
+  long outlen = 0;
+  bool owned = false;
+  buflen = 0;
 
-  /* resample float array */ 
   /* set desired sr ratio */ 
+  long orig_sr = reader.GetSampleRate();
   double sr_ratio = (double)(sr)/(double)orig_sr;
-  if (src_is_valid_ratio(sr_ratio) == 0){
-    free(inbuffer);
+  Resampler *resampler = Resampler::Get(orig_sr, sr, quality);
+  if (!resampler){
     return nullptr;
   }
 
-  /* allocate output buffer for conversion */ 
-  unsigned int outbufferlength = sr_ratio*inbufferlength;
-  float *outbuffer = (float*)malloc(outbufferlength*sizeof(float));
-  if (!outbuffer){
-    free(inbuffer);
+  if (start > 0 && !reader.Seek(start)){
     return nullptr;
   }
 
-  int error;
-  SRC_STATE *src_state = src_new(SRC_LINEAR, 1, &error);
-  if (!src_state){
-    free(inbuffer);
-    free(outbuffer);
-    return nullptr;
+  /* an estimate of the samples read to size the output */
+  long inlength = reader.GetLength();
+  if (inlength >= 0){
+    inlength = std::max(0L, inlength - start);
+  }
+  if (maxlength >= 0 && (inlength < 0 || maxlength < inlength)){
+    inlength = maxlength;
   }
 
-  SRC_DATA src_data;
-  src_data.data_in = inbuffer;
-  src_data.data_out = outbuffer;
-  src_data.input_frames = inbufferlength;
-  src_data.output_frames = outbufferlength;
-  src_data.end_of_input = SF_TRUE;
-  src_data.src_ratio = sr_ratio;
+  int error = 0;
+
+  /* decode, downmix and resample block by block, the resampler keeping its state from one
+   * block to the next, into the caller's buffer then into one growing as needed */
+  float inbuffer[block_length];
+  long nbread = 0;
+  bool eof = false;
+  while (!eof){
+    int count = block_length;
+    if (maxlength >= 0 && maxlength - nbread < count){
+      count = (int)(maxlength - nbread);
+    }
 
-  /* sample rate conversion */ 
-  if (error = src_process(src_state, &src_data)){
-    free(inbuffer);
-    free(outbuffer);
-    src_delete(src_state);
-    return nullptr;
+    int n = (count > 0) ? reader.Read(inbuffer, count) : 0;
+    if (n < 0){
+      break;
+    }
+    nbread += n;
+    eof = (n == 0);
+
+    const float *in = inbuffer;
+    long gen;
+    do {
+      long needed = (long)(sr_ratio*n) + 16;
+      if (outbufferlength - outlen < needed){
+        long length = std::max(2*outbufferlength, outlen + needed);
+        float *buffer;
+        if (owned){
+          buffer = (float*)realloc(outbuffer, length*sizeof(float));
+        } else {
+          /* first allocation sized for the whole signal when its length is known */
+          if (inlength >= 0){
+            length = std::max(length, (long)(sr_ratio*inlength) + 16);
+          }
+          buffer = (float*)malloc(length*sizeof(float));
+          if (buffer && outlen > 0){
+            memcpy(buffer, outbuffer, outlen*sizeof(float));
+          }
+        }
+        if (!buffer){
+          error = 1;
+          break;
+        }
+        outbuffer = buffer;
+        outbufferlength = length;
+        owned = true;
+      }
+
+      /* sample rate conversion */ 
+      long used;
+      gen = resampler->Process(in, n, eof, outbuffer + outlen, outbufferlength - outlen, used);
+      if (gen < 0){
+        error = 1;
+        break;
+      }
+      outlen += gen;
+      in += used;
+      n -= (int)used;
+    } while (n > 0 || (eof && gen > 0));
+
+    if (error){
+      break;
+    }
   }
 
-  buflen = src_data.output_frames;
+  if (error || !eof){
+    if (owned){
+      free(outbuffer);
+    }
+    return nullptr;
+  }
 
-  src_delete(src_state);
-  free(inbuffer);
+  /* as many samples as a single conversion of the whole signal */
+  buflen = (int)std::min(outlen, (long)(sr_ratio*nbread));
 
   return outbuffer;
-} 
+}
+
+}
+
+float* ph_readaudio2(const char *filename, int sr, float *sigbuf, int &buflen, const float start_sec, const float nbsecs,
+                     const ph_resample_quality quality){
+  auto reader = open_audio(filename);
+  if (!reader){
+    buflen = 0;
+    return nullptr;
+  }
+
+  long orig_sr = reader->GetSampleRate();
+  long start = (start_sec > 0) ? (long)(start_sec*orig_sr) : 0;
+  long maxlength = (nbsecs > 0) ? (long)(nbsecs*orig_sr) : -1;
+  return read_audio(*reader, sr, start, maxlength, quality, sigbuf, buflen);
+}
 
-float* ph_readaudio(const char *filename, int sr, int channels, float *sigbuf, int &buflen, const float nbsecs) {
+float* ph_readaudio(const char *filename, int sr, int channels, float *sigbuf, int &buflen, const float nbsecs,
+                    const ph_resample_quality quality) {
   if (!filename || sr <= 0)
     return nullptr;
-  return ph_readaudio2(filename, sr, sigbuf, buflen, nbsecs);
+  return ph_readaudio2(filename, sr, sigbuf, buflen, 0, nbsecs, quality);
 }
 
-uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames) {
-  int frame_length = 4096;//2^12
-  int nfft = frame_length;
-  int nfft_half = 2048;
-  int start = 0;
-  int end = start + frame_length - 1;
-  int overlap = (int)(31 * frame_length / 32);
-  int advance = frame_length - overlap;
-  int index = 0;
-  nb_frames = (int)(std::floor(N / advance) - std::floor(frame_length / advance) + 1);
-  double window[frame_length];
-  for (int i = 0; i < frame_length; i++) {
-    //hamming window
-    window[i] = 0.54 - 0.46*std::cos(2 * M_PI*i / (frame_length - 1));
-  }
+float* ph_readaudio_range(const char *filename, int sr, float *sigbuf, int &buflen, const float start_sec,
+                          const float duration_sec, const ph_resample_quality quality) {
+  if (!filename || sr <= 0 || start_sec < 0)
+    return nullptr;
+  return ph_readaudio2(filename, sr, sigbuf, buflen, start_sec, duration_sec, quality);
+}
 
-  double frame[frame_length];
-  //fftw_complex *pF;
-  //fftw_plan p;
-  //pF = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*nfft);
-  _Dcomplex *pF = (_Dcomplex*)malloc(sizeof(_Dcomplex)*nfft);
+namespace {
 
-  double magnF[nfft_half];
-  double maxF;// = 0.0;
-  double maxB;// = 0.0;
+/* Bark scale filters summing the magnitude spectrum of a frame into bands. The weight of a
+ * bin falls off exponentially with its distance in barks from the middle of the filter, but
+ * never reaches 0, so each filter only keeps the range of bins weighing at least
+ * MIN_WEIGHT, 60 dB below its peak. The dropped tail changes the bands by far less than the
+ * differences the hash bits are taken from.
+ */
+class BarkFilterbank {
+public:
+  static const int NB_FILTERS = 33;
+  static const int NFFT_HALF = 2048;
 
+  explicit BarkFilterbank(int sr);
+
+  void Apply(const double *magnF, double *bark) const;
+
+  // Filterbank shared by all hashes at sample rate sr, computed on the first call
+  static std::shared_ptr<const BarkFilterbank> Get(int sr);
+
+private:
+  static const double MIN_WEIGHT;
+
+  int                 m_start[NB_FILTERS];
+  int                 m_length[NB_FILTERS];
+  int                 m_offset[NB_FILTERS];  // of the filter in m_weights
+  std::vector<double> m_weights;
+};
+
+const double BarkFilterbank::MIN_WEIGHT = 1e-6;
+
+BarkFilterbank::BarkFilterbank(int sr) {
   double minfreq = 300;
   double maxfreq = 3000;
   double minbark = 6 * asinh(minfreq / 600.0);
   double maxbark = 6 * asinh(maxfreq / 600.0);
   double nyqbark = maxbark - minbark;
-  int nfilts = 33;
-  double stepbarks = nyqbark / (nfilts - 1);
-  int nb_barks = (int)(std::floor(nfft_half / 2 + 1));
+  double stepbarks = nyqbark / (NB_FILTERS - 1);
+  int nb_barks = NFFT_HALF / 2 + 1;
   double barkwidth = 1.06;
-
-  double freqs[nb_barks];
-  double binbarks[nb_barks];
-  double curr_bark[nfilts];
-  double prev_bark[nfilts];
-  for (int i = 0; i < nfilts; i++) {
-    prev_bark[i] = 0.0;
-  }
-  uint32_t *hash = (uint32_t*)malloc(nb_frames*sizeof(uint32_t));
   double lof, hif;
 
+  std::vector<double> binbarks(nb_barks);
   for (int i = 0; i < nb_barks; i++) {
-    binbarks[i] = 6 * asinh(i*sr / nfft_half / 600.0);
-    freqs[i] = i*sr / nfft_half;
-  }
-  double **wts = new double*[nfilts];
-  for (int i = 0; i < nfilts; i++) {
-    wts[i] = new double[nfft_half];
-  }
-  for (int i = 0; i < nfilts; i++) {
-    for (int j = 0; j < nfft_half; j++) {
-      wts[i][j] = 0.0;
-    }
+    binbarks[i] = 6 * asinh(i*sr / NFFT_HALF / 600.0);
   }
 
-  //calculate wts for each filter
-  for (int i = 0; i < nfilts; i++) {
+  //calculate wts for each filter, over the bins above MIN_WEIGHT
+  std::vector<double> wts(nb_barks);
+  for (int i = 0; i < NB_FILTERS; i++) {
     double f_bark_mid = minbark + i*stepbarks;
+    int first = nb_barks, last = -1;
     for (int j = 0; j < nb_barks; j++) {
       double barkdiff = binbarks[j] - f_bark_mid;
       lof = -2.5*(barkdiff / barkwidth - 0.5);
@@ -339,63 +548,348 @@ uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames) {
       double m = std::min(lof, hif);
       m = std::min(0.0, m);
       m = std::pow(10, m);
-      wts[i][j] = m;
+      wts[j] = m;
+      if (m >= MIN_WEIGHT) {
+        first = std::min(first, j);
+        last = j;
+      }
     }
+
+    m_start[i] = (last < 0) ? 0 : first;
+    m_length[i] = (last < 0) ? 0 : last - first + 1;
+    m_offset[i] = (int)m_weights.size();
+    m_weights.insert(m_weights.end(), wts.begin() + m_start[i], wts.begin() + m_start[i] + m_length[i]);
   }
+}
 
-  //p = fftw_plan_dft_r2c_1d(frame_length,frame,pF,FFTW_ESTIMATE);
+void BarkFilterbank::Apply(const double *magnF, double *bark) const {
+  for (int i = 0; i < NB_FILTERS; i++) {
+    const double *w = &m_weights[m_offset[i]];
+    const double *magn = magnF + m_start[i];
+    double sum = 0;
+    for (int j = 0; j < m_length[i]; j++) {
+      sum += w[j] * magn[j];
+    }
+    bark[i] = sum;
+  }
+}
+
+std::shared_ptr<const BarkFilterbank> BarkFilterbank::Get(int sr) {
+  static std::mutex mutex;
+  static std::map<int, std::shared_ptr<const BarkFilterbank>> filterbanks;
 
-  while (end < N) {
-    maxF = 0.0;
-    maxB = 0.0;
-    for (int i = 0; i < frame_length; i++) {
-      frame[i] = window[i] * buf[start + i];
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& filterbank = filterbanks[sr];
+  if (!filterbank) {
+    filterbank = std::make_shared<const BarkFilterbank>(sr);
+  }
+
+  return filterbank;
+}
+
+/* Hashes successive frames of a signal, keeping the bark bands of the previous frame that
+ * each hash is taken relative to.
+ */
+class AudioHasher {
+public:
+  static const int FRAME_LENGTH = 4096;//2^12
+  static const int ADVANCE = FRAME_LENGTH / 32;
+
+  explicit AudioHasher(int sr);
+
+  // Hash of the frame made of first[0..nfirst-1] followed by second[0..FRAME_LENGTH-nfirst-1]
+  uint32_t HashFrame(const float *first, int nfirst, const float *second);
+
+private:
+  static const int NB_FILTERS = BarkFilterbank::NB_FILTERS;
+  static const int NFFT_HALF = BarkFilterbank::NFFT_HALF;
+
+  std::shared_ptr<const FFTPlan>        m_plan;
+  std::shared_ptr<const BarkFilterbank> m_filterbank;
+  std::vector<double>                   m_window;
+  std::vector<double>                   m_frame;
+  std::vector<complex>                  m_spectrum;
+  std::vector<double>                   m_magnF;
+  double                                m_currBark[NB_FILTERS];
+  double                                m_prevBark[NB_FILTERS];
+};
+
+AudioHasher::AudioHasher(int sr)
+  : m_plan{ FFTPlan::Get(FRAME_LENGTH) }
+  , m_filterbank{ BarkFilterbank::Get(sr) }
+  , m_window(FRAME_LENGTH)
+  , m_frame(FRAME_LENGTH)
+  , m_spectrum(NFFT_HALF + 1)
+  , m_magnF(NFFT_HALF) {
+  for (int i = 0; i < FRAME_LENGTH; i++) {
+    //hamming window
+    m_window[i] = 0.54 - 0.46*std::cos(2 * M_PI*i / (FRAME_LENGTH - 1));
+  }
+  for (int i = 0; i < NB_FILTERS; i++) {
+    m_prevBark[i] = 0.0;
+  }
+}
+
+uint32_t AudioHasher::HashFrame(const float *first, int nfirst, const float *second) {
+  for (int i = 0; i < nfirst; i++) {
+    m_frame[i] = m_window[i] * first[i];
+  }
+  for (int i = nfirst; i < FRAME_LENGTH; i++) {
+    m_frame[i] = m_window[i] * second[i - nfirst];
+  }
+
+  m_plan->Execute(m_frame.data(), m_spectrum.data());
+  for (int i = 0; i < NFFT_HALF; i++) {
+    m_magnF[i] = sqrt(m_spectrum[i].x*m_spectrum[i].x + m_spectrum[i].y*m_spectrum[i].y);
+  }
+
+  m_filterbank->Apply(m_magnF.data(), m_currBark);
+
+  uint32_t curr_hash = 0x00000000u;
+  for (int m = 0; m < NB_FILTERS - 1; m++) {
+    double H = m_currBark[m] - m_currBark[m + 1] - (m_prevBark[m] - m_prevBark[m + 1]);
+    curr_hash = curr_hash << 1;
+    if (H > 0)
+      curr_hash |= 0x00000001;
+  }
+
+  for (int i = 0; i < NB_FILTERS; i++) {
+    m_prevBark[i] = m_currBark[i];
+  }
+
+  return curr_hash;
+}
+
+}
+
+uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames, const int threads) {
+  int frame_length = AudioHasher::FRAME_LENGTH;
+  int advance = AudioHasher::ADVANCE;
+  nb_frames = (int)(std::floor(N / advance) - std::floor(frame_length / advance) + 1);
+
+  uint32_t *hash = (uint32_t*)malloc(nb_frames*sizeof(uint32_t));
+
+  /* frames first to last-1, after the frame before first, whose bands are all a frame
+   * takes from the previous one, so each range gives the hashes of a single pass */
+  auto hash_range = [=](int first, int last) {
+    AudioHasher hasher(sr);
+    if (first > 0) {
+      hasher.HashFrame(buf + (first - 1)*advance, frame_length, nullptr);
     }
-    //fftw_execute(p);
-    if (fft(frame, frame_length, pF) < 0) {
-      return nullptr;
+    for (int index = first; index < last; index++) {
+      hash[index] = hasher.HashFrame(buf + index*advance, frame_length, nullptr);
     }
-    for (int i = 0; i < nfft_half; i++) {
-      //magnF[i] = sqrt(pF[i][0]*pF[i][0] +  pF[i][1]*pF[i][1] );
-      magnF[i] = cabs(pF[i]);
-      if (magnF[i] > maxF) {
-        maxF = magnF[i];
-      }
+  };
+
+  /* ranges of at least min_frames, for the warm-up frame to stay a small part of each */
+  const int min_frames = 64;
+  int nbranges = 1;
+  if (threads != 1 && hash != nullptr && nb_frames > 0) {
+    int num_threads = (threads > 0) ? threads : ThreadPool::GetNumCores();
+    nbranges = std::max(1, std::min(num_threads, nb_frames / min_frames));
+  }
+
+  if (nbranges == 1) {
+    hash_range(0, std::max(nb_frames, 0));
+    return hash;
+  }
+
+  ThreadPool pool(nbranges);
+  std::vector<std::future<void>> pending;
+  for (int r = 0; r < nbranges; r++) {
+    int first = (int)((long)nb_frames*r / nbranges);
+    int last = (int)((long)nb_frames*(r + 1) / nbranges);
+    pending.push_back(pool.Submit([=] { hash_range(first, last); }));
+  }
+  for (auto& result : pending) {
+    result.get();
+  }
+
+  return hash;
+}
+
+/* State of a streamed audio hash: the last FRAME_LENGTH samples in a ring, the oldest at
+ * m_write once the ring is full.
+ */
+struct ph_audiohash_state {
+  ph_audiohash_state(int sr, ph_audiohash_cb callback, void *arg)
+    : m_hasher(sr)
+    , m_ring(AudioHasher::FRAME_LENGTH)
+    , m_write{ 0 }
+    , m_needed{ AudioHasher::FRAME_LENGTH }
+    , m_count{ 0 }
+    , m_stopped{ false }
+    , m_callback{ callback }
+    , m_arg{ arg } {}
+
+  AudioHasher        m_hasher;
+  std::vector<float> m_ring;
+  int                m_write;    // next sample in m_ring
+  int                m_needed;   // samples until the next frame
+  int                m_count;    // hashes passed to m_callback
+  bool               m_stopped;
+  ph_audiohash_cb    m_callback;
+  void*              m_arg;
+};
+
+ph_audiohash_state* ph_audiohash_begin(const int sr, ph_audiohash_cb callback, void *arg) {
+  if (sr <= 0 || callback == nullptr)
+    return nullptr;
+
+  return new ph_audiohash_state(sr, callback, arg);
+}
+
+int ph_audiohash_feed(ph_audiohash_state *state, const float *buf, const int N) {
+  if (state == nullptr || (buf == nullptr && N > 0) || N < 0)
+    return -1;
+
+  const int frame_length = AudioHasher::FRAME_LENGTH;
+  int count = 0;
+  int left = N;
+
+  while (left > 0 && !state->m_stopped) {
+    int n = std::min(left, state->m_needed);
+    int n1 = std::min(n, frame_length - state->m_write);
+
+    memcpy(&state->m_ring[state->m_write], buf, n1*sizeof(float));
+    memcpy(&state->m_ring[0], buf + n1, (n - n1)*sizeof(float));
+    state->m_write = (state->m_write + n) % frame_length;
+    state->m_needed -= n;
+    buf += n;
+    left -= n;
+
+    if (state->m_needed == 0) {
+      const float *oldest = &state->m_ring[state->m_write];
+      uint32_t hash = state->m_hasher.HashFrame(oldest, frame_length - state->m_write, &state->m_ring[0]);
+
+      state->m_needed = AudioHasher::ADVANCE;
+      state->m_count++;
+      count++;
+      if (state->m_callback(hash, state->m_arg) == 0)
+        state->m_stopped = true;
     }
+  }
+
+  return count;
+}
+
+int ph_audiohash_end(ph_audiohash_state *state) {
+  if (state == nullptr)
+    return -1;
+
+  int count = state->m_count;
+  delete state;
+
+  return count;
+}
+
+uint32_t* ph_audiohash_chunked(const char *filename, const int sr, const float chunk_secs, const int threads,
+                               int &nbframes, const ph_resample_quality quality) {
+  nbframes = 0;
+  if (!filename || sr <= 0)
+    return nullptr;
+
+  const long frame_length = AudioHasher::FRAME_LENGTH;
+  const long advance = AudioHasher::ADVANCE;
+
+  /* samples read before and after those of a chunk, for the resampler to settle */
+  const long margin = 1024;
+
+  auto reader = open_audio(filename);
+  if (!reader)
+    return nullptr;
+  long orig_sr = reader->GetSampleRate();
+  long length = reader->GetLength();
+  reader.reset();
+
+  /* sample k of the output falls on sample k*M/L of the file, so the chunks are read from
+   * multiples of L for their samples to fall where they do in the whole signal */
+  long L = sr, M = orig_sr;
+  while (M != 0) {
+    long t = L % M;
+    L = M;
+    M = t;
+  }
+  M = orig_sr / L;
+  L = sr / L;
+
+  /* frames of the whole file from its length, as ph_audiohash would count them */
+  long chunk_frames = (chunk_secs > 0) ? (long)(chunk_secs*sr) / advance : 0;
+  long total_length = (length >= 0) ? (long)(((double)sr / (double)orig_sr) * length) : -1;
+  long total_frames = (total_length >= frame_length) ? (total_length - frame_length) / advance + 1 : 0;
+  int nbchunks = 1;
+  if (chunk_frames > 0 && total_frames > chunk_frames) {
+    nbchunks = (int)((total_frames + chunk_frames - 1) / chunk_frames);
+  }
 
-    for (int i = 0; i < nfilts; i++) {
-      curr_bark[i] = 0;
-      for (int j = 0; j < nfft_half; j++) {
-        curr_bark[i] += wts[i][j] * magnF[j];
+  std::vector<std::vector<uint32_t>> chunks(nbchunks);
+  std::vector<char> failed(nbchunks, 0);
+
+  ThreadPool pool(std::min(threads, nbchunks));
+  std::vector<std::future<void>> pending;
+  for (int c = 0; c < nbchunks; c++) {
+    pending.push_back(pool.Submit([&, c] {
+      bool last = (c == nbchunks - 1);
+      long first = c*chunk_frames*advance;
+
+      /* the frame before the first one, whose bands the first hash is taken against */
+      long warmup = (c > 0) ? advance : 0;
+      long begin = first - warmup - margin;
+      begin = (begin > 0) ? (begin / L) * L : 0;
+      long skip = first - warmup - begin;
+
+      long maxlength = -1;
+      if (!last) {
+        long needed = first + (chunk_frames - 1)*advance + frame_length - begin;
+        maxlength = (needed*M + L - 1) / L + (margin*M + L - 1) / L;
       }
-      if (curr_bark[i] > maxB)
-        maxB = curr_bark[i];
-    }
 
-    uint32_t curr_hash = 0x00000000u;
-    for (int m = 0; m < nfilts - 1; m++) {
-      double H = curr_bark[m] - curr_bark[m + 1] - (prev_bark[m] - prev_bark[m + 1]);
-      curr_hash = curr_hash << 1;
-      if (H > 0)
-        curr_hash |= 0x00000001;
-    }
+      auto chunk_reader = open_audio(filename);
+      int N = 0;
+      float *buf = chunk_reader ? read_audio(*chunk_reader, sr, begin / L * M, maxlength, quality, nullptr, N) : nullptr;
+      if (buf == nullptr) {
+        failed[c] = 1;
+        return;
+      }
 
-    hash[index] = curr_hash;
-    for (int i = 0; i < nfilts; i++) {
-      prev_bark[i] = curr_bark[i];
-    }
-    index += 1;
-    start += advance;
-    end += advance;
+      AudioHasher hasher(sr);
+      long pos = skip;
+      if (warmup > 0 && pos + frame_length <= N) {
+        hasher.HashFrame(buf + pos, (int)frame_length, nullptr);
+        pos += advance;
+      }
+      while (pos + frame_length <= N && (last || (long)chunks[c].size() < chunk_frames)) {
+        chunks[c].push_back(hasher.HashFrame(buf + pos, (int)frame_length, nullptr));
+        pos += advance;
+      }
+      free(buf);
+    }));
+  }
+  for (auto& result : pending) {
+    result.get();
   }
 
-  //fftw_destroy_plan(p);
-  //fftw_free(pF);
-  free(pF);
-  for (int i = 0; i < nfilts; i++) {
-    delete[] wts[i];
+  /* the length of mp3 files being an estimate, the file may end before the last chunk */
+  size_t count = 0;
+  int used = 0;
+  while (used < nbchunks) {
+    if (failed[used])
+      return nullptr;
+    count += chunks[used].size();
+    if (used++ < nbchunks - 1 && (long)chunks[used - 1].size() < chunk_frames)
+      break;
   }
-  delete[] wts;
+
+  uint32_t *hash = (uint32_t*)malloc(std::max<size_t>(count, 1)*sizeof(uint32_t));
+  if (hash == nullptr)
+    return nullptr;
+  count = 0;
+  for (int c = 0; c < used; c++) {
+    std::copy(chunks[c].begin(), chunks[c].end(), hash + count);
+    count += chunks[c].size();
+  }
+  nbframes = (int)count;
+
   return hash;
 }
 
@@ -410,20 +904,65 @@ int ph_bitcount(uint32_t n){
     n = (n & MASK_01010101) + ((n >> 1) & MASK_01010101) ;
     n = (n & MASK_00110011) + ((n >> 2) & MASK_00110011) ;
     n = (n & MASK_00001111) + ((n >> 4) & MASK_00001111) ;
-    return n % 255;
+    return (n * 0x01010101u) >> 24;
 
 }
 
-double ph_compare_blocks(const uint32_t *ptr_blockA,const uint32_t *ptr_blockB, const int block_size){
-    double result = 0;
-    for (int i=0;i<block_size;i++){
-	uint32_t xordhash = ptr_blockA[i]^ptr_blockB[i];
-        result += ph_bitcount(xordhash);
+namespace {
+
+/* number of bits differing between blockA and blockB, two hashes at a time */
+inline int block_distance(const uint32_t *blockA, const uint32_t *blockB, const int block_size){
+    const uint64_t m1 = 0x5555555555555555ULL;
+    const uint64_t m2 = 0x3333333333333333ULL;
+    const uint64_t h01 = 0x0101010101010101ULL;
+    const uint64_t m4 = 0x0f0f0f0f0f0f0f0fULL;
+    int count = 0;
+    int i = 0;
+    for (;i + 1 < block_size;i += 2){
+        uint64_t a, b;
+        memcpy(&a, blockA + i, sizeof(a));
+        memcpy(&b, blockB + i, sizeof(b));
+        uint64_t x = a^b;
+        x -= (x >> 1) & m1;
+        x = (x & m2) + ((x >> 2) & m2);
+        x = (x + (x >> 4)) & m4;
+        count += (int)((x * h01) >> 56);
     }
+    if (i < block_size){
+        count += ph_bitcount(blockA[i]^blockB[i]);
+    }
+    return count;
+}
+
+/* confidence score of hashB aligned to hashA, over M blocks of block_size hashes */
+double ber_confidence(const uint32_t *hashA, const uint32_t *hashB, const int M, const int block_size, const float threshold){
+    double sum_above = 0, sum_below = 0;
+    for (int n = 0; n < M; n++) {
+      double dist = (double)block_distance(hashA + n*block_size, hashB + n*block_size, block_size)/(32*block_size);
+      if (dist <= threshold) {
+        sum_below += 1 - dist;
+      } else {
+        sum_above += 1 - dist;
+      }
+    }
+    double above_factor = sum_above / M;
+    double below_factor = sum_below / M;
+    return 0.5*(1 + below_factor - above_factor);
+}
+
+}
+
+double ph_compare_blocks(const uint32_t *ptr_blockA,const uint32_t *ptr_blockB, const int block_size){
+    double result = block_distance(ptr_blockA, ptr_blockB, block_size);
     result = result/(32*block_size);
     return result;
 }
+
 double* ph_audio_distance_ber(uint32_t *hash_a, const int Na, uint32_t *hash_b, const int Nb, const float threshold, const int block_size, int &Nc) {
+  return ph_audio_distance_ber_seeded(hash_a, Na, hash_b, Nb, threshold, block_size, Nc, 0);
+}
+
+double* ph_audio_distance_ber_seeded(uint32_t *hash_a, const int Na, uint32_t *hash_b, const int Nb, const float threshold, const int block_size, int &Nc, const int min_matches) {
 
   uint32_t *ptrA, *ptrB;
   int N1, N2;
@@ -441,83 +980,51 @@ double* ph_audio_distance_ber(uint32_t *hash_a, const int Na, uint32_t *hash_b,
     N2 = Na;
   }
 
-  double *pC = new double[Nc];
-  if (!pC)
+  if (N1 <= 0 || block_size <= 0) {
+    Nc = 0;
     return nullptr;
-  int k, M, nb_above, nb_below, hash1_index, hash2_index;
-  double sum_above, sum_below, above_factor, below_factor;
-
-  uint32_t *pha, *phb;
-  double *dist = nullptr;
-
-  for (int i = 0; i < Nc; i++) {
-    M = (int)std::floor(std::min(N1, N2 - i) / block_size);
-
-    pha = ptrA;
-    phb = ptrB + i;
-
-    double *tmp_dist = (double*)realloc(dist, M*sizeof(double));
-    if (!tmp_dist) {
-      return nullptr;
-    }
-    dist = tmp_dist;
-    dist[0] = ph_compare_blocks(pha, phb, block_size);
-
-    k = 1;
+  }
 
-    pha += block_size;
-    phb += block_size;
+  /* the whole shorter hash as a single block when it is shorter than block_size */
+  int bs = std::min(block_size, N1);
+  int M = N1 / bs;
 
-    hash1_index = block_size;
-    hash2_index = i + block_size;
+  double *pC = new double[Nc];
+  if (!pC)
+    return nullptr;
 
-    while ((hash1_index < N1 - block_size) && (hash2_index < N2 - block_size)) {
-      dist[k++] = ph_compare_blocks(pha, phb, block_size);
-      hash1_index += block_size;
-      hash2_index += block_size;
-      pha += block_size;
-      phb += block_size;
+  if (min_matches <= 0) {
+    for (int i = 0; i < Nc; i++) {
+      pC[i] = ber_confidence(ptrA, ptrB + i, M, bs, threshold);
     }
+    return pC;
+  }
 
-    sum_above = 0;
-    sum_below = 0;
-    nb_above = 0;
-    nb_below = 0;
-    for (int n = 0; n < M; n++) {
-      if (dist[n] <= threshold) {
-        sum_below += 1 - dist[n];
-        nb_below++;
-      } else {
-        sum_above += 1 - dist[n];
-        nb_above++;
+  /* offsets aligning at least min_matches identical hashes, found from the sorted hashes
+   * of the longer signal */
+  std::vector<std::pair<uint32_t, int>> sorted(N2);
+  for (int j = 0; j < N2; j++) {
+    sorted[j] = std::make_pair(ptrB[j], j);
+  }
+  std::sort(sorted.begin(), sorted.end());
+
+  std::vector<int> matches(Nc, 0);
+  for (int j = 0; j < N1; j++) {
+    auto range = std::equal_range(sorted.begin(), sorted.end(), std::make_pair(ptrA[j], 0),
+      [](const std::pair<uint32_t, int>& x, const std::pair<uint32_t, int>& y) { return x.first < y.first; });
+    for (auto it = range.first; it != range.second; ++it) {
+      int i = it->second - j;
+      if (i >= 0 && i < Nc) {
+        matches[i]++;
       }
     }
-    above_factor = sum_above / M;
-    below_factor = sum_below / M;
-    pC[i] = 0.5*(1 + below_factor - above_factor);
   }
 
-  free(dist);
-  return pC;
-}
-
-#if HAVE_PTHREAD
-
-void *ph_audio_thread(void *pSlice) {
-  ph_slice *s = (ph_slice *)pSlice;
-  for (int i = 0; i < s->n; ++i)  {
-    ph_datapoint *dp = (ph_datapoint *)s->hash_p[i];
-    int N, count;
-    std::pair<int, int> *p = (std::pair<int, int> *)s->hash_params;
-    float *buf = ph_readaudio(dp->id, p->first, p->second, nullptr, N, 0.0F);
-    uint32_t *hash = ph_audiohash(buf, N, p->first, count);
-    free(buf);
- //   buf = nullptr;
-    dp->hash = hash;
-    dp->hash_length = count;
+  for (int i = 0; i < Nc; i++) {
+    pC[i] = (matches[i] >= min_matches) ? ber_confidence(ptrA, ptrB + i, M, bs, threshold) : 0.0;
   }
 
-  return nullptr;
+  return pC;
 }
 
 ph_datapoint** ph_audio_hashes(char *files[], int count, int sr, int channels, int threads) {
@@ -530,7 +1037,7 @@ ph_datapoint** ph_audio_hashes(char *files[], int count, int sr, int channels, i
   } else if (threads > 0) {
     num_threads = threads;
   } else {
-    num_threads = ph_num_threads();
+    num_threads = 0;
   }
 
   ph_datapoint **hashes = (ph_datapoint**)malloc(count*sizeof(ph_datapoint*));
@@ -540,31 +1047,28 @@ ph_datapoint** ph_audio_hashes(char *files[], int count, int sr, int channels, i
     hashes[i]->id = strdup(files[i]);
   }
 
-  pthread_t thds[num_threads];
-
-  int rem = count % num_threads;
-  int start = 0;
-  int off;
-  ph_slice *s = new ph_slice[num_threads];
-  for (int n = 0; n < num_threads; ++n) {
-    off = (int)std::floor((count / (float)num_threads) + (rem>0 ? num_threads - (count % num_threads) : 0));
-
-    s[n].hash_p = &hashes[start];
-    s[n].n = off;
-    s[n].hash_params = new std::pair<int, int>(sr, channels);
-    start += off;
-    --rem;
-    pthread_create(&thds[n], nullptr, ph_audio_thread, &s[n]);
+  /* one file per task, so each thread reuses its decoder from one file to the next */
+  ThreadPool pool(num_threads);
+  std::vector<std::future<void>> pending;
+  for (int i = 0; i < count; ++i) {
+    ph_datapoint *dp = hashes[i];
+    pending.push_back(pool.Submit([dp, sr, channels] {
+      int N, nbframes = 0;
+      uint32_t *hash = nullptr;
+      float *buf = ph_readaudio(dp->id, sr, channels, nullptr, N, 0.0F);
+      if (buf != nullptr) {
+        hash = ph_audiohash(buf, N, sr, nbframes);
+        free(buf);
+      }
+      dp->hash = hash;
+      dp->hash_length = (hash != nullptr) ? nbframes : 0;
+    }));
   }
-  for (int i = 0; i < num_threads; ++i) {
-    pthread_join(thds[i], nullptr);
-    delete (std::pair<int, int>*)s[i].hash_params;
+  for (auto& result : pending) {
+    result.get();
   }
-  delete[] s;
 
   return hashes;
 }
 
-#endif
-
 #endif /* HAVE_AUDIO_HASH */
@@ -0,0 +1,526 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    David Starkweather - dstarkweather@phash.org
+
+*/
+
+#include "internal.h"
+#if HAVE_AUDIO_HASH
+
+#include "audioindex.h"
+#include "audiohash.h"
+#include "ThreadPool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#include <future>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char INDEX_MAGIC[8] = { 'P', 'H', 'A', 'U', 'D', 'I', 'D', 'X' };
+const uint32_t INDEX_VERSION = 1;
+
+/* keys are bucketed by their top bits, so a lookup only searches the keys of its bucket */
+const int BUCKET_BITS = 16;
+const int NB_BUCKETS = 1 << BUCKET_BITS;
+
+/* hashes with more postings than this do not vote, being too common to tell tracks apart */
+const uint64_t MAX_POSTINGS = 1 << 16;
+
+/* offsets with the most votes scored by a query, at least */
+const int MIN_CANDIDATES = 32;
+
+/* file layout: the header, then each section aligned on 8 bytes at its offset */
+struct IndexHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t nb_tracks;
+  uint64_t nb_frames;
+  uint64_t nb_keys;
+  uint64_t tracks_offset;    // uint64_t[nb_tracks + 1], first frame of each track
+  uint64_t frames_offset;    // uint32_t[nb_frames], hashes of the tracks
+  uint64_t buckets_offset;   // uint64_t[NB_BUCKETS + 1], first key of each bucket
+  uint64_t keys_offset;      // uint32_t[nb_keys], distinct hashes in order
+  uint64_t starts_offset;    // uint64_t[nb_keys + 1], first posting of each key
+  uint64_t postings_offset;  // Posting[nb_frames]
+  uint64_t size;
+};
+
+struct Posting {
+  uint32_t track;
+  uint32_t offset;
+};
+
+/* posting with its hash, while building */
+struct Entry {
+  uint32_t hash;
+  uint32_t track;
+  uint32_t offset;
+
+  bool operator<(const Entry& other) const {
+    if (hash != other.hash) return hash < other.hash;
+    if (track != other.track) return track < other.track;
+    return offset < other.offset;
+  }
+};
+
+inline uint64_t align8(uint64_t n) {
+  return (n + 7) & ~(uint64_t)7;
+}
+
+inline bool section_fits(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t size) {
+  return offset <= size && count <= (size - offset) / elem_size && (offset & 7) == 0;
+}
+
+}
+
+struct ph_audio_index {
+  ph_audio_index()
+    : header{ nullptr }
+    , tracks{ nullptr }
+    , frames{ nullptr }
+    , buckets{ nullptr }
+    , keys{ nullptr }
+    , starts{ nullptr }
+    , postings{ nullptr }
+#if defined(_WIN32)
+    , file{ INVALID_HANDLE_VALUE }
+    , mapping{ nullptr }
+#else
+    , fd{ -1 }
+#endif
+    , map{ nullptr }
+    , mapSize{ 0 } {}
+
+  ~ph_audio_index() {
+#if defined(_WIN32)
+    if (map != nullptr) UnmapViewOfFile(map);
+    if (mapping != nullptr) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (map != nullptr) munmap(map, mapSize);
+    if (fd >= 0) close(fd);
+#endif
+  }
+
+  /* points the sections at an index laid out from base, false if it is not a valid index */
+  bool SetSections(const uint8_t *base, uint64_t size) {
+    if (size < sizeof(IndexHeader))
+      return false;
+
+    const IndexHeader *h = (const IndexHeader*)base;
+    if (memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || h->version != INDEX_VERSION || h->size != size)
+      return false;
+    if (!section_fits(h->tracks_offset, (uint64_t)h->nb_tracks + 1, sizeof(uint64_t), size) ||
+        !section_fits(h->frames_offset, h->nb_frames, sizeof(uint32_t), size) ||
+        !section_fits(h->buckets_offset, (uint64_t)NB_BUCKETS + 1, sizeof(uint64_t), size) ||
+        !section_fits(h->keys_offset, h->nb_keys, sizeof(uint32_t), size) ||
+        !section_fits(h->starts_offset, h->nb_keys + 1, sizeof(uint64_t), size) ||
+        !section_fits(h->postings_offset, h->nb_frames, sizeof(Posting), size))
+      return false;
+
+    /* the bounds of the tracks and buckets are checked here, those of the keys' postings,
+     * one per key, when a query reads them */
+    const uint64_t *t = (const uint64_t*)(base + h->tracks_offset);
+    if (t[0] != 0 || t[h->nb_tracks] != h->nb_frames)
+      return false;
+    for (uint32_t i = 0; i < h->nb_tracks; i++) {
+      if (t[i] > t[i + 1] || t[i + 1] - t[i] > (uint64_t)INT_MAX)
+        return false;
+    }
+    const uint64_t *b = (const uint64_t*)(base + h->buckets_offset);
+    if (b[0] != 0 || b[NB_BUCKETS] != h->nb_keys)
+      return false;
+    for (int i = 0; i < NB_BUCKETS; i++) {
+      if (b[i] > b[i + 1])
+        return false;
+    }
+
+    header = h;
+    tracks = (const uint64_t*)(base + h->tracks_offset);
+    frames = (const uint32_t*)(base + h->frames_offset);
+    buckets = (const uint64_t*)(base + h->buckets_offset);
+    keys = (const uint32_t*)(base + h->keys_offset);
+    starts = (const uint64_t*)(base + h->starts_offset);
+    postings = (const Posting*)(base + h->postings_offset);
+
+    return true;
+  }
+
+  /* postings [first, last) of a hash, empty if it is not in the index or its postings are
+   * out of bounds */
+  void Find(uint32_t hash, uint64_t &first, uint64_t &last) const {
+    uint32_t b = hash >> (32 - BUCKET_BITS);
+    const uint32_t *begin = keys + buckets[b];
+    const uint32_t *end = keys + buckets[b + 1];
+    const uint32_t *key = std::lower_bound(begin, end, hash);
+    first = last = 0;
+    if (key != end && *key == hash) {
+      uint64_t start = starts[key - keys];
+      uint64_t stop = starts[key - keys + 1];
+      if (start <= stop && stop <= header->nb_frames) {
+        first = start;
+        last = stop;
+      }
+    }
+  }
+
+  /* whether a posting read from the index points into one of its tracks */
+  bool IsValid(const Posting& posting) const {
+    return posting.track < header->nb_tracks &&
+           posting.offset < tracks[posting.track + 1] - tracks[posting.track];
+  }
+
+  const IndexHeader* header;
+  const uint64_t*    tracks;
+  const uint32_t*    frames;
+  const uint64_t*    buckets;
+  const uint32_t*    keys;
+  const uint64_t*    starts;
+  const Posting*     postings;
+
+  /* built index */
+  std::vector<uint64_t> storage;
+
+  /* mapped index */
+#if defined(_WIN32)
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int    fd;
+#endif
+  void*    map;
+  uint64_t mapSize;
+};
+
+ph_audio_index* ph_audio_index_build(uint32_t **hashes, const int *lengths, const int nbtracks, const int threads) {
+  if (!hashes || !lengths || nbtracks <= 0)
+    return nullptr;
+
+  std::vector<uint64_t> tracks(nbtracks + 1);
+  tracks[0] = 0;
+  for (int t = 0; t < nbtracks; t++) {
+    if (lengths[t] < 0 || (lengths[t] > 0 && hashes[t] == nullptr))
+      return nullptr;
+    tracks[t + 1] = tracks[t] + lengths[t];
+  }
+  const uint64_t nb_frames = tracks[nbtracks];
+
+  ThreadPool pool(threads);
+  std::vector<std::future<void>> pending;
+  auto wait = [&pending] {
+    for (auto& task : pending) {
+      task.get();
+    }
+    pending.clear();
+  };
+
+  /* chunks of consecutive tracks of about the same number of frames, a few per thread */
+  std::vector<int> chunks(1, 0);
+  const int nb_chunks = 4 * std::max(1, pool.GetNumThreads());
+  for (int t = 0; t < nbtracks; t++) {
+    if (tracks[t + 1] * nb_chunks >= nb_frames * chunks.size() || t == nbtracks - 1) {
+      chunks.push_back(t + 1);
+    }
+  }
+  const int nbc = (int)chunks.size() - 1;
+
+  /* postings of each chunk in each bucket */
+  std::vector<std::vector<uint64_t>> counts(nbc, std::vector<uint64_t>(NB_BUCKETS + 1, 0));
+  for (int c = 0; c < nbc; c++) {
+    pending.push_back(pool.Submit([&, c] {
+      for (int t = chunks[c]; t < chunks[c + 1]; t++) {
+        for (int i = 0; i < lengths[t]; i++) {
+          counts[c][hashes[t][i] >> (32 - BUCKET_BITS)]++;
+        }
+      }
+    }));
+  }
+  wait();
+
+  /* where each chunk writes the postings of each bucket, in track order */
+  std::vector<uint64_t> bucket_starts(NB_BUCKETS + 1, 0);
+  for (int b = 0; b < NB_BUCKETS; b++) {
+    uint64_t pos = bucket_starts[b];
+    for (int c = 0; c < nbc; c++) {
+      uint64_t count = counts[c][b];
+      counts[c][b] = pos;
+      pos += count;
+    }
+    bucket_starts[b + 1] = pos;
+  }
+
+  std::vector<Entry> entries(nb_frames);
+  for (int c = 0; c < nbc; c++) {
+    pending.push_back(pool.Submit([&, c] {
+      std::vector<uint64_t>& pos = counts[c];
+      for (int t = chunks[c]; t < chunks[c + 1]; t++) {
+        for (int i = 0; i < lengths[t]; i++) {
+          uint32_t hash = hashes[t][i];
+          Entry& e = entries[pos[hash >> (32 - BUCKET_BITS)]++];
+          e.hash = hash;
+          e.track = t;
+          e.offset = i;
+        }
+      }
+    }));
+  }
+  wait();
+  counts.clear();
+
+  /* sort each bucket and count its distinct hashes */
+  const int BUCKETS_PER_TASK = 256;
+  std::vector<uint64_t> key_starts(NB_BUCKETS + 1, 0);
+  for (int b0 = 0; b0 < NB_BUCKETS; b0 += BUCKETS_PER_TASK) {
+    pending.push_back(pool.Submit([&, b0] {
+      for (int b = b0; b < b0 + BUCKETS_PER_TASK; b++) {
+        auto first = entries.begin() + bucket_starts[b];
+        auto last = entries.begin() + bucket_starts[b + 1];
+        std::sort(first, last);
+        uint64_t nb_keys = 0;
+        for (auto e = first; e != last; ++e) {
+          if (e == first || e->hash != (e - 1)->hash)
+            nb_keys++;
+        }
+        key_starts[b + 1] = nb_keys;
+      }
+    }));
+  }
+  wait();
+  for (int b = 0; b < NB_BUCKETS; b++) {
+    key_starts[b + 1] += key_starts[b];
+  }
+  const uint64_t nb_keys = key_starts[NB_BUCKETS];
+
+  IndexHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  h.version = INDEX_VERSION;
+  h.nb_tracks = nbtracks;
+  h.nb_frames = nb_frames;
+  h.nb_keys = nb_keys;
+  h.tracks_offset = align8(sizeof(IndexHeader));
+  h.frames_offset = align8(h.tracks_offset + (nbtracks + 1)*sizeof(uint64_t));
+  h.buckets_offset = align8(h.frames_offset + nb_frames*sizeof(uint32_t));
+  h.keys_offset = align8(h.buckets_offset + (NB_BUCKETS + 1)*sizeof(uint64_t));
+  h.starts_offset = align8(h.keys_offset + nb_keys*sizeof(uint32_t));
+  h.postings_offset = align8(h.starts_offset + (nb_keys + 1)*sizeof(uint64_t));
+  h.size = align8(h.postings_offset + nb_frames*sizeof(Posting));
+
+  ph_audio_index *index = new ph_audio_index();
+  index->storage.resize(h.size / sizeof(uint64_t));
+  uint8_t *base = (uint8_t*)index->storage.data();
+  memcpy(base, &h, sizeof(h));
+  memcpy(base + h.tracks_offset, tracks.data(), tracks.size()*sizeof(uint64_t));
+  memcpy(base + h.buckets_offset, key_starts.data(), key_starts.size()*sizeof(uint64_t));
+  index->SetSections(base, h.size);
+
+  uint32_t *frames = (uint32_t*)(base + h.frames_offset);
+  uint32_t *keys = (uint32_t*)(base + h.keys_offset);
+  uint64_t *starts = (uint64_t*)(base + h.starts_offset);
+  Posting *postings = (Posting*)(base + h.postings_offset);
+
+  for (int c = 0; c < nbc; c++) {
+    pending.push_back(pool.Submit([&, c] {
+      for (int t = chunks[c]; t < chunks[c + 1]; t++) {
+        if (lengths[t] > 0)
+          memcpy(frames + tracks[t], hashes[t], lengths[t]*sizeof(uint32_t));
+      }
+    }));
+  }
+  for (int b0 = 0; b0 < NB_BUCKETS; b0 += BUCKETS_PER_TASK) {
+    pending.push_back(pool.Submit([&, b0] {
+      for (int b = b0; b < b0 + BUCKETS_PER_TASK; b++) {
+        uint64_t k = key_starts[b];
+        for (uint64_t p = bucket_starts[b]; p < bucket_starts[b + 1]; p++) {
+          const Entry& e = entries[p];
+          if (p == bucket_starts[b] || e.hash != entries[p - 1].hash) {
+            keys[k] = e.hash;
+            starts[k++] = p;
+          }
+          postings[p].track = e.track;
+          postings[p].offset = e.offset;
+        }
+      }
+    }));
+  }
+  wait();
+  starts[nb_keys] = nb_frames;
+
+  return index;
+}
+
+int ph_audio_index_save(const ph_audio_index *index, const char *filename) {
+  if (!index || !filename)
+    return -1;
+
+  FILE *file = fopen(filename, "wb");
+  if (!file)
+    return -1;
+
+  size_t size = (size_t)index->header->size;
+  size_t written = fwrite(index->header, 1, size, file);
+  if (fclose(file) != 0 || written != size)
+    return -1;
+
+  return 0;
+}
+
+ph_audio_index* ph_audio_index_open(const char *filename) {
+  if (!filename)
+    return nullptr;
+
+  ph_audio_index *index = new ph_audio_index();
+
+#if defined(_WIN32)
+  LARGE_INTEGER size;
+  index->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (index->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(index->file, &size) || size.QuadPart <= 0) {
+    delete index;
+    return nullptr;
+  }
+  index->mapSize = (uint64_t)size.QuadPart;
+  index->mapping = CreateFileMapping(index->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (index->mapping != nullptr) {
+    index->map = MapViewOfFile(index->mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+#else
+  struct stat st;
+  index->fd = open(filename, O_RDONLY);
+  if (index->fd < 0 || fstat(index->fd, &st) < 0 || st.st_size <= 0) {
+    delete index;
+    return nullptr;
+  }
+  index->mapSize = (uint64_t)st.st_size;
+  index->map = mmap(nullptr, index->mapSize, PROT_READ, MAP_SHARED, index->fd, 0);
+  if (index->map == MAP_FAILED) {
+    index->map = nullptr;
+  }
+#endif
+
+  if (index->map == nullptr || !index->SetSections((const uint8_t*)index->map, index->mapSize)) {
+    delete index;
+    return nullptr;
+  }
+
+  return index;
+}
+
+void ph_audio_index_free(ph_audio_index *index) {
+  delete index;
+}
+
+int ph_audio_index_nbtracks(const ph_audio_index *index) {
+  return index ? (int)index->header->nb_tracks : 0;
+}
+
+int ph_audio_index_query(const ph_audio_index *index, const uint32_t *hash, const int N, const int max_flips,
+                         const float threshold, const int block_size, ph_audio_match *matches, const int max_matches) {
+  if (!index || !hash || N <= 0 || max_flips < 0 || max_flips > 2 || !matches || max_matches <= 0)
+    return -1;
+
+  /* votes of the query hashes and their neighbours for each (track, offset), the offset
+   * relative to the first hash of the query */
+  std::unordered_map<uint64_t, int> votes;
+  std::vector<uint32_t> probes;
+  for (int j = 0; j < N; j++) {
+    probes.clear();
+    probes.push_back(hash[j]);
+    for (int a = 0; a < 32 && max_flips >= 1; a++) {
+      probes.push_back(hash[j] ^ (1u << a));
+      for (int b = a + 1; b < 32 && max_flips >= 2; b++) {
+        probes.push_back(hash[j] ^ (1u << a) ^ (1u << b));
+      }
+    }
+
+    for (uint32_t probe : probes) {
+      uint64_t first, last;
+      index->Find(probe, first, last);
+      if (last - first > MAX_POSTINGS)
+        continue;
+      for (uint64_t p = first; p < last; p++) {
+        const Posting& posting = index->postings[p];
+        if (!index->IsValid(posting))
+          continue;
+        int32_t offset = (int32_t)posting.offset - j;
+        votes[((uint64_t)posting.track << 32) | (uint32_t)offset]++;
+      }
+    }
+  }
+
+  std::vector<ph_audio_match> candidates;
+  candidates.reserve(votes.size());
+  for (const auto& vote : votes) {
+    ph_audio_match match;
+    match.track = (int)(vote.first >> 32);
+    match.offset = (int32_t)(uint32_t)vote.first;
+    match.votes = vote.second;
+    match.confidence = 0;
+    candidates.push_back(match);
+  }
+
+  size_t nb_candidates = std::min(candidates.size(), (size_t)std::max(MIN_CANDIDATES, 4*max_matches));
+  std::partial_sort(candidates.begin(), candidates.begin() + nb_candidates, candidates.end(),
+    [](const ph_audio_match& a, const ph_audio_match& b) {
+      if (a.votes != b.votes) return a.votes > b.votes;
+      if (a.track != b.track) return a.track < b.track;
+      return a.offset < b.offset;
+    });
+  candidates.resize(nb_candidates);
+
+  /* score each candidate over the frames where the query and the track overlap */
+  for (auto& match : candidates) {
+    const uint32_t *track = index->frames + index->tracks[match.track];
+    int track_length = (int)(index->tracks[match.track + 1] - index->tracks[match.track]);
+    int query_start = std::max(0, -match.offset);
+    int track_start = std::max(0, match.offset);
+    int length = std::min(N - query_start, track_length - track_start);
+
+    int Nc = 0;
+    double *pC = ph_audio_distance_ber((uint32_t*)hash + query_start, length, (uint32_t*)track + track_start, length,
+                                       threshold, block_size, Nc);
+    match.confidence = (pC && Nc > 0) ? pC[0] : 0;
+    delete[] pC;
+  }
+
+  std::stable_sort(candidates.begin(), candidates.end(),
+    [](const ph_audio_match& a, const ph_audio_match& b) { return a.confidence > b.confidence; });
+
+  int count = (int)std::min(candidates.size(), (size_t)max_matches);
+  std::copy(candidates.begin(), candidates.begin() + count, matches);
+
+  return count;
+}
+
+#endif /* HAVE_AUDIO_HASH */
@@ -24,71 +24,157 @@ David Starkweather - dstarkweather@phash.org
 
 #include "fft.h"
 
+#include <map>
+#include <mutex>
 #include <math.h>
 
-struct complex {
-  complex() = default;
+namespace {
 
-  complex(double r, double i)
-    : x{ r }
-    , y{ i } {}
+inline complex polar_to_complex(const double r, const double theta) {
+  return complex(r * cos(theta), r * sin(theta));
+}
 
-  inline complex operator+(const complex b) const {
-    return complex(x + b.x, y + b.y);
-  }
+inline complex conj(const complex a) {
+  return complex(a.x, -a.y);
+}
 
-  inline complex operator-(const complex b) const {
-    return complex(x - b.x, y - b.y);
-  }
+}
+
+FFTPlan::FFTPlan(int N)
+  : m_size{ N } {
+  int M = N / 2;
+  int bits = 0;
 
-  inline complex operator*(const complex b) const {
-    return complex((x * b.x) - (y * b.y), (x * b.y) + (y * b.x));
+  while ((1 << bits) < M) {
+    bits++;
   }
 
-  double x, y; // real and imaginary parts
-};
+  m_bitReverse.resize(M > 0 ? M : 0);
+  for (int n = 0; n < M; n++) {
+    int r = 0;
+    for (int b = 0; b < bits; b++) {
+      r |= ((n >> b) & 1) << (bits - 1 - b);
+    }
+    m_bitReverse[n] = r;
+  }
 
-namespace {
+  // Twiddles of each stage side by side, so the butterflies read them in order
+  for (int len = 2; len <= M; len *= 2) {
+    for (int j = 0; j < len / 2; j++) {
+      m_twiddles.push_back(polar_to_complex(1.0, 2.0 * M_PI * j / len));
+    }
+  }
 
-inline complex polar_to_complex(const double r, const double theta) {
-  return complex(r * cos(theta), r * sin(theta));
+  for (int k = 0; k <= M / 2; k++) {
+    m_realTwiddles.push_back(polar_to_complex(1.0, 2.0 * M_PI * k / N));
+  }
 }
 
-inline void fft_calc(const int N, const double* x, complex* X, complex* P, const int step, const complex* twids) {
+void FFTPlan::Execute(const double* x, complex* X) const {
+  const int M = m_size / 2;
   int k;
-  complex* S = P + N / 2;
 
-  if (N == 1) {
-    X[0].x = x[0];
-    X[0].y = 0;
+  if (M == 0) {
+    X[0] = complex(x[0], 0);
     return;
   }
 
-  fft_calc(N / 2, x, S, X, 2 * step, twids);
-  fft_calc(N / 2, x + step, P, X, 2 * step, twids);
+  // Even samples as the real parts and odd ones as the imaginary parts of a complex
+  // signal of half the length, transformed in place in X[0..M-1]. The bit reversal
+  // permutation is its own inverse, so X[k] loads sample pair m_bitReverse[k].
+  const complex* twids = m_twiddles.data();
+  int len = 2;
+
+  if (M >= 4) {
+    // First two stages at once, their twiddles being 1 and +i
+    for (k = 0; k < M; k += 4) {
+      const int* r = &m_bitReverse[k];
+      const complex a0(x[2 * r[0]], x[2 * r[0] + 1]);
+      const complex a1(x[2 * r[1]], x[2 * r[1] + 1]);
+      const complex a2(x[2 * r[2]], x[2 * r[2] + 1]);
+      const complex a3(x[2 * r[3]], x[2 * r[3] + 1]);
+      const complex b0 = a0 + a1;
+      const complex b1 = a0 - a1;
+      const complex b2 = a2 + a3;
+      const complex ib3(a3.y - a2.y, a2.x - a3.x);
+
+      X[k] = b0 + b2;
+      X[k + 1] = b1 + ib3;
+      X[k + 2] = b0 - b2;
+      X[k + 3] = b1 - ib3;
+    }
+    twids += 1 + 2;
+    len = 8;
+  } else {
+    for (k = 0; k < M; k++) {
+      X[m_bitReverse[k]] = complex(x[2 * k], x[2 * k + 1]);
+    }
+  }
+
+  for (; len <= M; len *= 2) {
+    const int half = len / 2;
+    for (int start = 0; start < M; start += len) {
+      complex* S = X + start;
+      complex* P = S + half;
+      for (k = 0; k < half; k++) {
+        complex t = P[k] * twids[k];
+        P[k] = S[k] - t;
+        S[k] = S[k] + t;
+      }
+    }
+    twids += half;
+  }
 
-  for (k = 0; k < N / 2; k++) {
-    P[k] = P[k] * twids[k * step];
-    X[k] = S[k] + P[k];
-    X[k + N / 2] = S[k] - P[k];
+  // Split into the transforms E of the even and O of the odd samples, and combine them
+  // as X[k] = E[k] + W^k O[k], X[M - k] = conj(E[k] - W^k O[k]) with W^M = -1
+  const complex Z0 = X[0];
+  X[0] = complex(Z0.x + Z0.y, 0);
+  X[M] = complex(Z0.x - Z0.y, 0);
+
+  for (k = 1; k <= M / 2; k++) {
+    const complex a = X[k];
+    const complex b = conj(X[M - k]);
+    const complex s = a + b;
+    const complex d = a - b;
+    const complex E(0.5 * s.x, 0.5 * s.y);
+    const complex O(0.5 * d.y, -0.5 * d.x);
+    const complex WO = m_realTwiddles[k] * O;
+
+    X[k] = E + WO;
+    X[M - k] = conj(E - WO);
   }
 }
 
+std::shared_ptr<const FFTPlan> FFTPlan::Get(int N) {
+  static std::mutex mutex;
+  static std::map<int, std::shared_ptr<const FFTPlan>> plans;
+
+  if (N <= 0 || (N & (N - 1)) != 0) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& plan = plans[N];
+  if (!plan) {
+    plan = std::make_shared<const FFTPlan>(N);
+  }
+
+  return plan;
 }
 
 int fft(const double* x, const int N, complex* X) {
-  complex* twiddle_factors = new complex[(N / 2)];
-  complex* Xt = new complex[N];
+  auto plan = FFTPlan::Get(N);
   int k;
 
-  for (k = 0; k < N / 2; k++) {
-    twiddle_factors[k] = polar_to_complex(1.0, 2.0 * M_PI * k / N);
+  if (!plan) {
+    return -1;
   }
 
-  fft_calc(N, x, X, Xt, 1, twiddle_factors);
+  plan->Execute(x, X);
 
-  delete[] twiddle_factors;
-  delete[] Xt;
+  for (k = N / 2 + 1; k < N; k++) {
+    X[k] = conj(X[N - k]);
+  }
 
   return 0;
 }
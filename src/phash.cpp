@@ -30,6 +30,8 @@ D Grant Starkweather - dstarkweather@phash.org
 #include <string.h>
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <deque>
 #include <math.h>
 #include <dirent.h>
 #if !defined(__GLIBC__) && !defined(_WIN32)
@@ -551,40 +553,92 @@ DP** ph_dct_image_hashes(char *files[], int count, int threads) {
 
 #ifdef HAVE_VIDEO_HASH
 
-uint64_t* ph_dct_videohash(const char *filename, int &Length) {
-  auto keyframes = VideoProcessor::GetSceneChangeFrames(filename);
-  if(keyframes == nullptr) {
-    return nullptr;
+static uint64_t ph_dct_keyframehash(const CImageI& keyframe, const CImageF& C, const CImageF& Ctransp) {
+  CImageI currentframe(keyframe);
+  currentframe.blur(1.0);
+  CImageF dctImage = C*(currentframe)*Ctransp;
+  CImageF subsec = dctImage.crop(1, 1, 8, 8).unroll('x');
+  auto med = subsec.median();
+  uint64_t hash = 0x0000000000000000;
+  uint64_t one = 0x0000000000000001;
+  for(auto j = 0; j < 64; j++) {
+    if(subsec(j) > med)
+      hash |= one;
+    one = one << 1;
   }
 
-  Length = keyframes->size();
-  
-  auto hash = static_cast<uint64_t*>(malloc(sizeof(uint64_t)*Length));
+  return hash;
+}
+
+int ph_dct_videohash_version(ph_video_sampling sampling, ph_video_decode decode) {
+  return (decode << 12) | (sampling << 8) | PH_VIDEOHASH_VERSION;
+}
+
+int ph_dct_videohash_stream(const char *filename, ph_videohash_cb callback, void *arg, ph_video_sampling sampling, ph_video_decode decode, int threads) {
+  if(!filename || !callback)
+    return -1;
+
   auto C = ph_dct_matrix(32);
   auto Ctransp = C->get_transpose();
-  CImageF dctImage;
-  CImageF subsec;
-  CImageI currentframe;
-
-
-  for(unsigned int i = 0; i < keyframes->size(); i++) {
-    currentframe = keyframes->at(i);
-    currentframe.blur(1.0);
-    dctImage = (*C)*(currentframe)*Ctransp;
-    subsec = dctImage.crop(1, 1, 8, 8).unroll('x');
-    auto med = subsec.median();
-    hash[i] = 0x0000000000000000;
-    uint64_t one = 0x0000000000000001;
-    for(auto j = 0; j < 64; j++) {
-      if(subsec(j) > med)
-        hash[i] |= one;
-      one = one << 1;
+  auto count = 0;
+  auto stop = false;
+
+  // The keyframes are hashed on the pool that computes the frame histograms, and their
+  // hashes passed to callback in order. With a single thread the pool runs them inline.
+  DecodeOptions options;
+  options.keyFramesOnly = sampling == PH_VIDEO_SAMPLE_KEYFRAMES;
+  options.fastDecode = decode == PH_VIDEO_DECODE_FAST;
+  options.numThreads = threads;
+
+  ThreadPool pool(threads);
+  std::deque<std::future<uint64_t>> pending;
+  auto deliver = [&]() {
+    auto hash = pending.front().get();
+    pending.pop_front();
+    if(!stop) {
+      count++;
+      stop = callback(hash, arg) == 0;
+    }
+  };
+
+  auto success = VideoProcessor::GetSceneChangeFrames(filename, [&](const CImageI& keyframe) {
+    auto pKeyframe = std::make_shared<CImageI>(keyframe);
+    pending.push_back(pool.Submit([pKeyframe, C, &Ctransp] {
+      return ph_dct_keyframehash(*pKeyframe, *C, Ctransp);
+    }));
+
+    while(!stop && (static_cast<int>(pending.size()) > pool.GetNumThreads())) {
+      deliver();
     }
+
+    return !stop;
+  }, options, &pool);
+
+  while(!pending.empty()) {
+    deliver();
   }
 
-  keyframes->clear();
   delete C;
 
+  return success ? count : -1;
+}
+
+uint64_t* ph_dct_videohash(const char *filename, int &Length, ph_video_sampling sampling, ph_video_decode decode, int threads) {
+  std::vector<uint64_t> hashes;
+  auto append = [](uint64_t hash, void *arg) {
+    static_cast<std::vector<uint64_t>*>(arg)->push_back(hash);
+    return 1;
+  };
+
+  if(ph_dct_videohash_stream(filename, append, &hashes, sampling, decode, threads) < 0) {
+    return nullptr;
+  }
+
+  Length = hashes.size();
+  
+  auto hash = static_cast<uint64_t*>(malloc(sizeof(uint64_t)*Length));
+  std::copy(hashes.begin(), hashes.end(), hash);
+
   return hash;
 }
 
@@ -595,7 +649,8 @@ void *ph_video_thread(void *p) {
   for(auto i = 0; i < s->n; ++i) {
     auto dp = static_cast<DP *>(s->hash_p[i]);
     int N;
-    auto hash = ph_dct_videohash(dp->id, N);
+    // one thread per file, the files being hashed on one thread per core already
+    auto hash = ph_dct_videohash(dp->id, N, PH_VIDEO_SAMPLE_ALL, PH_VIDEO_DECODE_FULL, 1);
     if(hash) {
       dp->hash = hash;
       dp->hash_length = N;
@@ -657,45 +712,69 @@ DP** ph_dct_video_hashes(char *files[], int count, int threads) {
 
 #endif /* HAVE_PTHREAD */
 
-inline int matrix_size(int zx, int zy) {
-  return (((zx)+1) * ((zy)+1));
-}
-
-inline int matrix_pos(int zx, int x, int y) {
-  return ((x) * (((zx)+1) + (y)));
+double ph_dct_videohash_dist(uint64_t* hashA, int N1, uint64_t* hashB, int N2, int threshold) {
+  return ph_dct_videohash_dist_banded(hashA, N1, hashB, N2, threshold, -1);
 }
 
-double ph_dct_videohash_dist(uint64_t* hashA, int N1, uint64_t* hashB, int N2, int threshold) {
+double ph_dct_videohash_dist_banded(uint64_t* hashA, int N1, uint64_t* hashB, int N2, int threshold, int band) {
   int den = (N1 <= N2) ? N1 : N2;
-  auto* m = new int[matrix_size(N1, N2)];
-
-  for(auto i = 0; i < N1 + 1; i++) {
-    m[matrix_pos(N1, i, 0)] = 0;
-  }
 
-  for(auto j = 0; j < N2 + 1; j++) {
-    m[matrix_pos(N1, 0, j)] = 0;
-  }
+  // Bit-parallel LCS: each hash of the shorter video is a bit of V, and each hash of the
+  // longer one a row of the DP, whose matches update all of V a word at a time. The zero
+  // bits of V count the length of the LCS.
+  auto rows = hashA;
+  auto numRows = N1;
+  auto cols = hashB;
+  auto numCols = N2;
+  if(N1 < N2) {
+    std::swap(rows, cols);
+    std::swap(numRows, numCols);
+  }
+
+  auto numWords = (numCols + 63) / 64;
+  std::vector<uint64_t> V(numWords, ~0ULL);
+  std::vector<uint64_t> M(numWords);
+
+  for(auto i = 0; i < numRows; i++) {
+    // Matches of the row, around the diagonal scaled to the lengths of the videos if banded
+    auto jBegin = 0;
+    auto jEnd = numCols;
+    if(band >= 0) {
+      auto center = static_cast<int>(static_cast<int64_t>(i) * numCols / numRows);
+      jBegin = (center - band > 0) ? center - band : 0;
+      jEnd = (center + band + 1 < numCols) ? center + band + 1 : numCols;
+    }
 
-  for(auto i = 1; i < N1 + 1; i++) {
-    for(auto j = 1; j < N2 + 1; j++) {
-      auto d = ph_hamming_distance(hashA[i - 1], hashB[j - 1]);
+    for(auto j = jBegin; j < jEnd; j++) {
+      if(ph_hamming_distance(rows[i], cols[j]) <= threshold)
+        M[j >> 6] |= 1ULL << (j & 63);
+    }
 
-      if(d <= threshold) {
-        m[matrix_pos(N1, i, j)] = m[matrix_pos(N1, i - 1, j - 1)] + 1;
-      } else {
-        m[matrix_pos(N1, i, j)] =
-          ((m[matrix_pos(N1, i - 1, j)] >= m[matrix_pos(N1, i, j - 1)]))
-          ? m[matrix_pos(N1, i - 1, j)]
-          : m[matrix_pos(N1, i, j - 1)];
-      }
+    // V = (V + (V & M)) | (V & ~M), the addition carried across the words. The words
+    // below the band have no match and no carry, so they are left as they are, and the
+    // ones above it only change while a carry runs through them. M is cleared as it is
+    // used, for the next row.
+    auto wLast = (jEnd - 1) >> 6;
+    uint64_t carry = 0;
+    for(auto w = jBegin >> 6; (w < numWords) && ((w <= wLast) || carry); w++) {
+      auto u = V[w] & M[w];
+      auto t = V[w] + u;
+      auto s = t + carry;
+      carry = ((t < V[w]) || (s < t)) ? 1 : 0;
+      V[w] = s | (V[w] & ~M[w]);
+      M[w] = 0;
     }
   }
 
-  auto result = static_cast<double>(m[matrix_pos(N1, N1, N2)]) / static_cast<double>(den);
-  delete[] m;
+  auto lcs = numCols;
+  for(auto w = 0; w < numWords; w++) {
+    auto bits = V[w];
+    if((w == numWords - 1) && (numCols & 63))
+      bits &= (1ULL << (numCols & 63)) - 1;
+    lcs -= ph_hamming_distance(bits, 0);
+  }
 
-  return result;
+  return static_cast<double>(lcs) / static_cast<double>(den);
 }
 
 #endif /* HAVE_VIDEO_HASH */
@@ -797,107 +876,104 @@ double ph_hammingdistance2(uint8_t *hashA, int lenA, uint8_t *hashB, int lenB) {
 }
 
 TxtHashPoint* ph_texthash(const char *filename, int *nbpoints) {
-  int count;
-  TxtHashPoint *TxtHash;
-  TxtHashPoint WinHash[WindowLength];
-  char kgram[KgramLength];
-
   auto pfile = fopen(filename, "r");
   if(!pfile) {
     return nullptr;
   }
   struct stat fileinfo;
   fstat(fileno(pfile), &fileinfo);
-  count = fileinfo.st_size - WindowLength + 1;
-  count = static_cast<int>(0.01*count);
-  int d;
-  uint64_t hashword = 0ULL;
 
-  TxtHash = static_cast<TxtHashPoint*>(malloc(count * sizeof(struct ph_hash_point)));
+  /* one point per WindowLength kgrams, the first kgram taking KgramLength characters */
+  off_t maxpoints = (fileinfo.st_size - KgramLength + 1) / WindowLength + 1;
+  int count = static_cast<int>(std::max<off_t>(maxpoints, 1));
+
+  auto TxtHash = static_cast<TxtHashPoint*>(malloc(count * sizeof(struct ph_hash_point)));
   if(!TxtHash) {
+    fclose(pfile);
     return nullptr;
   }
   *nbpoints = 0;
-  int i, first = 0, last = KgramLength - 1;
-  int text_index = 0;
-  int win_index = 0;
-  for(i = 0; i < KgramLength; i++) {    /* calc first kgram */
-    d = fgetc(pfile);
-    if(d == EOF) {
-      free(TxtHash);
-      return nullptr;
-    }
-    if(d <= 47)         /*skip cntrl chars*/
-      continue;
-    if(((d >= 58) && (d <= 64)) || ((d >= 91) && (d <= 96)) || (d >= 123)) /*skip punct*/
+
+  /* key of each character, lower case letters and digits only, -1 for the skipped ones */
+  int symbol[256];
+  for(int c = 0; c < 256; c++) {
+    if((c <= 47) || ((c >= 58) && (c <= 64)) || ((c >= 91) && (c <= 96)) || (c >= 123))
+      symbol[c] = -1;   /*skip cntrl chars and punct*/
+    else if((c >= 65) && (c <= 90))
+      symbol[c] = c + 32;   /*convert upper to lower case */
+    else
+      symbol[c] = c;
+  }
+
+  /* read in large blocks rather than a character at a time */
+  std::vector<unsigned char> block(1 << 16);
+  size_t n = fread(block.data(), 1, block.size(), pfile);
+  if(n < static_cast<size_t>(KgramLength)) {
+    free(TxtHash);
+    fclose(pfile);
+    return nullptr;
+  }
+
+  /* keys of the characters of the kgram, 0 for those skipped */
+  uint64_t kgram[KgramLength] = { 0 };
+  uint64_t hashword = 0ULL;
+  int first = 0, last = KgramLength - 1;
+  off_t text_index = 0;
+  for(int i = 0; i < KgramLength; i++) {    /* calc first kgram */
+    int d = symbol[block[i]];
+    if(d < 0)
       continue;
-    if((d >= 65) && (d <= 90))       /*convert upper to lower case */
-      d = d + 32;
 
-    kgram[i] = static_cast<char>(d);
+    kgram[i] = textkeys[d];
     hashword = hashword << delta;   /* rotate left or shift left ??? */
     hashword = hashword^textkeys[d];/* right now, rotate breaks it */
   }
 
-  WinHash[win_index].hash = hashword;
-  WinHash[win_index++].index = text_index;
+  /* the windows follow one another without overlapping, so the minimum of a window is a
+   * running minimum restarted with each window, the last of equal hashes winning */
   struct ph_hash_point minhash;
-  minhash.hash = ULLONG_MAX;
-  minhash.index = 0;
+  minhash.hash = hashword;
+  minhash.index = text_index;
   struct ph_hash_point prev_minhash;
   prev_minhash.hash = ULLONG_MAX;
   prev_minhash.index = 0;
+  int win_count = 1;
+
+  size_t pos = KgramLength;
+  do {
+    for(; pos < n; pos++) {    /*remaining kgrams */
+      text_index++;
+      int d = symbol[block[pos]];
+      if(d < 0)
+        continue;
+
+      uint64_t oldsym = kgram[first%KgramLength];
+
+      /* rotate or left shift ??? */
+      /* right now, rotate breaks it */
+      oldsym = oldsym << delta*KgramLength;
+      hashword = hashword << delta;
+      hashword = hashword^textkeys[d];
+      hashword = hashword^oldsym;
+      kgram[last%KgramLength] = textkeys[d];
+      first++;
+      last++;
+
+      if(win_count == 0 || hashword <= minhash.hash) {
+        minhash.hash = hashword;
+        minhash.index = text_index;
+      }
 
-  while((d = fgetc(pfile)) != EOF) {    /*remaining kgrams */
-    text_index++;
-    if(d == EOF) {
-      free(TxtHash);
-      return nullptr;
-    }
-    if(d <= 47)         /*skip cntrl chars*/
-      continue;
-    if(((d >= 58) && (d <= 64)) || ((d >= 91) && (d <= 96)) || (d >= 123)) /*skip punct*/
-      continue;
-    if((d >= 65) && (d <= 90))       /*convert upper to lower case */
-      d = d + 32;
-
-    uint64_t oldsym = textkeys[kgram[first%KgramLength]];
-
-    /* rotate or left shift ??? */
-    /* right now, rotate breaks it */
-    oldsym = oldsym << delta*KgramLength;
-    hashword = hashword << delta;
-    hashword = hashword^textkeys[d];
-    hashword = hashword^oldsym;
-    kgram[last%KgramLength] = static_cast<char>(d);
-    first++;
-    last++;
-
-    WinHash[win_index%WindowLength].hash = hashword;
-    WinHash[win_index%WindowLength].index = text_index;
-    win_index++;
-
-    if(win_index >= WindowLength) {
-      minhash.hash = ULLONG_MAX;
-      for(i = win_index; i<win_index + WindowLength; i++) {
-        if(WinHash[i%WindowLength].hash <= minhash.hash) {
-          minhash.hash = WinHash[i%WindowLength].hash;
-          minhash.index = WinHash[i%WindowLength].index;
+      if(++win_count == WindowLength) {
+        if(minhash.hash != prev_minhash.hash) {
+          prev_minhash = minhash;
         }
+        TxtHash[(*nbpoints)++] = prev_minhash;
+        win_count = 0;
       }
-      if(minhash.hash != prev_minhash.hash) {
-        TxtHash[(*nbpoints)].hash = minhash.hash;
-        TxtHash[(*nbpoints)++].index = minhash.index;
-        prev_minhash.hash = minhash.hash;
-        prev_minhash.index = minhash.index;
-
-      } else {
-        TxtHash[*nbpoints].hash = prev_minhash.hash;
-        TxtHash[(*nbpoints)++].index = prev_minhash.index;
-      }
-      win_index = 0;
     }
-  }
+    pos = 0;
+  } while((n = fread(block.data(), 1, block.size(), pfile)) > 0);
 
   fclose(pfile);
   return TxtHash;
@@ -245,10 +245,113 @@ PHASHEXPORT int ph_hamming_distance(const uint64_t hash1, const uint64_t hash2);
 
 #ifdef HAVE_VIDEO_HASH
 
-PHASHEXPORT uint64_t* ph_dct_videohash(const char* filename, int &Length);
+/* version of the video hashes, see ph_dct_videohash_version */
+#define PH_VIDEOHASH_VERSION 1
+
+/*
+* How the frames of a video are sampled to find its scenes and their keyframes.
+*
+* PH_VIDEO_SAMPLE_ALL decodes every frame and samples about two per second.
+*
+* PH_VIDEO_SAMPLE_KEYFRAMES decodes only the key frames (I-frames) and samples each of them.
+* It is faster the longer the groups of pictures between key frames, by an amount that
+* depends on the codec and the encoding. The sampling then follows the encoder's key frame
+* placement rather than the clock: with a key frame every 2-10s the scene windows span that
+* much more time, short scenes without a key frame of their own are merged into their
+* neighbours, and encoders that insert key frames at cuts put the boundaries on them. The
+* hashes are close to, but not the same as, those of PH_VIDEO_SAMPLE_ALL, and differ between
+* two encodings of a video with different key frame intervals.
+*/
+typedef enum ph_video_sampling {
+  PH_VIDEO_SAMPLE_ALL = 0,
+  PH_VIDEO_SAMPLE_KEYFRAMES
+} ph_video_sampling;
+
+/*
+* How the sampled frames are decoded.
+*
+* PH_VIDEO_DECODE_FULL decodes them at full quality and scales them bicubic.
+*
+* PH_VIDEO_DECODE_FAST decodes them at a quarter of the resolution where the codec supports
+* it (lowres), without the loop filter and with the IDCT of B-frames skipped, and scales them
+* bilinear. The frames are only used as 64 bin histograms and 32x32 thumbnails, so the
+* hashes stay close to those of a full decode, but scene boundaries near the threshold can
+* move and change the number of hashes. The speedup depends on the codec, lowres being
+* supported by e.g. MPEG-1/2, MPEG-4 part 2 and MJPEG but not H.264 or HEVC.
+* The bench_video example (contrib/examples/bench_dctvideohash.cpp) measures both on a set
+* of videos.
+*/
+typedef enum ph_video_decode {
+  PH_VIDEO_DECODE_FULL = 0,
+  PH_VIDEO_DECODE_FAST
+} ph_video_decode;
+
+/*
+* Hashes are only comparable with hashes of the same version, to be stored along with them.
+*
+* @brief version of the hashes of ph_dct_videohash for a sampling and decode mode
+* @param sampling - ph_video_sampling mode
+* @param decode - ph_video_decode mode
+* @return int value - version, PH_VIDEOHASH_VERSION for the default modes
+*/
+PHASHEXPORT int ph_dct_videohash_version(ph_video_sampling sampling, ph_video_decode decode = PH_VIDEO_DECODE_FULL);
+
+/*
+* @brief dct video robust hash
+* @param filename - name of file
+* @param Length - (out) number of hashes
+* @param sampling - ph_video_sampling mode
+* @param decode - ph_video_decode mode
+* @param threads - threads decoding and hashing the video, 0 for one per core, 1 to run
+*                  everything on the calling thread when hashing several videos at once
+* @return uint64_t* array of hashes, NULL for error
+*/
+PHASHEXPORT uint64_t* ph_dct_videohash(const char* filename, int &Length, ph_video_sampling sampling = PH_VIDEO_SAMPLE_ALL, ph_video_decode decode = PH_VIDEO_DECODE_FULL, int threads = 0);
+
+/*
+* @brief call back receiving the hashes of ph_dct_videohash_stream
+* @param hash - uint64_t hash of the keyframe of a scene
+* @param arg - user argument passed to ph_dct_videohash_stream
+* @return int value - 0 to stop reading the video, non-zero to go on
+*/
+typedef int (*ph_videohash_cb)(uint64_t hash, void* arg);
+
+/*
+* Same hashes as ph_dct_videohash, passed to callback as each scene closes rather than
+* returned at the end, so long videos and live streams are hashed in constant memory.
+*
+* @brief dct video robust hash, streamed
+* @param filename - name of file
+* @param callback - function called with the hash of each scene, in order
+* @param arg - user argument passed to callback
+* @param sampling - ph_video_sampling mode
+* @param decode - ph_video_decode mode
+* @param threads - threads decoding and hashing the video, 0 for one per core, 1 to run
+*                  everything on the calling thread
+* @return int value - number of hashes passed to callback, less than 0 for error
+*/
+PHASHEXPORT int ph_dct_videohash_stream(const char* filename, ph_videohash_cb callback, void* arg, ph_video_sampling sampling = PH_VIDEO_SAMPLE_ALL, ph_video_decode decode = PH_VIDEO_DECODE_FULL, int threads = 0);
 
 PHASHEXPORT double ph_dct_videohash_dist(uint64_t* hashA, int N1, uint64_t* hashB, int N2, int threshold = 21);
 
+/*
+* Same as ph_dct_videohash_dist, but a keyframe of the longer video only matches the
+* keyframes of the other within band of its position scaled to the length of the other,
+* so each keyframe is compared with 2 * band + 1 others instead of all of them. The result
+* is a lower bound of ph_dct_videohash_dist, equal to it when the matches stay within the
+* band.
+*
+* @brief banded distance between dct video hashes
+* @param hashA - hashes of the first video
+* @param N1 - number of hashes in hashA
+* @param hashB - hashes of the second video
+* @param N2 - number of hashes in hashB
+* @param threshold - largest hamming distance of matching keyframes
+* @param band - number of keyframes matched on each side of the diagonal, less than 0 for all
+* @return double value - length of the longest matching sequence, over the length of the shorter video
+*/
+PHASHEXPORT double ph_dct_videohash_dist_banded(uint64_t* hashA, int N1, uint64_t* hashB, int N2, int threshold, int band);
+
 #endif /* HAVE_VIDEO_HASH */
 
 /*
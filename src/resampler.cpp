@@ -0,0 +1,289 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    David Starkweather - dstarkweather@phash.org
+
+*/
+
+#include "internal.h"
+#if HAVE_AUDIO_HASH
+
+#include "resampler.h"
+
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include <samplerate.h>
+
+namespace {
+
+/* largest number of phases, sr_out / gcd(sr_in, sr_out), of the built-in converter */
+const long MAX_PHASES = 1024;
+
+/* largest table of the built-in converter, in taps */
+const long MAX_TAPS = 1 << 20;
+
+/* pass band, as a fraction of the nyquist frequency of the lower rate */
+const double PASS_BAND = 0.9;
+
+long gcd(long a, long b) {
+  while (b != 0) {
+    long t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* Windowed sinc low pass filter sampled at the L phases of a conversion by L / M: the taps
+ * of phase p weigh the K input samples around an output falling p / L of a sample after
+ * an input sample.
+ */
+class PolyphaseFilter {
+public:
+  PolyphaseFilter(long L, long M, int zeros);
+
+  long GetNumPhases() const { return m_phases; }
+  int GetNumTaps() const { return m_taps; }
+  const float* GetPhase(long p) const { return &m_table[p*m_taps]; }
+
+  // Filter shared by all conversions by L / M, computed on the first call
+  static std::shared_ptr<const PolyphaseFilter> Get(long L, long M, int zeros);
+
+private:
+  long               m_phases;
+  int                m_taps;
+  std::vector<float> m_table;
+};
+
+PolyphaseFilter::PolyphaseFilter(long L, long M, int zeros)
+  : m_phases{ L } {
+  /* cut off, in cycles per input sample, times 2 */
+  double fc2 = PASS_BAND * std::min(1.0, (double)L / (double)M);
+  int half = (int)ceil(zeros / fc2);
+
+  m_taps = 2 * half;
+  m_table.resize(L * m_taps);
+  for (long p = 0; p < L; p++) {
+    float *taps = &m_table[p*m_taps];
+    double sum = 0;
+    for (int j = 0; j < m_taps; j++) {
+      double t = (j - half + 1) - (double)p / L;
+      double x = fc2 * t;
+      double sinc = (x == 0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+      double w = (t + half) / (2.0 * half);
+      double blackman = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+      taps[j] = (float)(fc2 * sinc * blackman);
+      sum += taps[j];
+    }
+    /* unit gain at DC for every phase */
+    for (int j = 0; j < m_taps; j++) {
+      taps[j] = (float)(taps[j] / sum);
+    }
+  }
+}
+
+std::shared_ptr<const PolyphaseFilter> PolyphaseFilter::Get(long L, long M, int zeros) {
+  static std::mutex mutex;
+  static std::map<std::tuple<long, long, int>, std::shared_ptr<const PolyphaseFilter>> filters;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& filter = filters[std::make_tuple(L, M, zeros)];
+  if (!filter) {
+    filter = std::make_shared<const PolyphaseFilter>(L, M, zeros);
+  }
+
+  return filter;
+}
+
+/* Built-in converter by L / M. Output k falls at k M / L in the input, and is the dot
+ * product of the phase (k M) mod L of the filter with the input samples around it. The
+ * signal is padded with zeros on both sides.
+ */
+class PolyphaseResampler : public Resampler {
+public:
+  PolyphaseResampler(long sr_in, long sr_out, ph_resample_quality quality, std::shared_ptr<const PolyphaseFilter> filter)
+    : Resampler(sr_in, sr_out, quality)
+    , m_filter{ filter }
+    , m_L{ filter->GetNumPhases() }
+    , m_M{ sr_in / (sr_out / filter->GetNumPhases()) }
+    , m_half{ filter->GetNumTaps() / 2 } {
+    Reset();
+  }
+
+  void Reset() override {
+    /* zeros before the first sample, for the taps of the first outputs */
+    m_buf.assign(m_half - 1, 0.0f);
+    m_base = -(m_half - 1);
+    m_total = 0;
+    m_next = 0;
+    m_flushed = false;
+  }
+
+  long Process(const float *in, long n, bool eof, float *out, long outlen, long &used) override {
+    m_buf.insert(m_buf.end(), in, in + n);
+    m_total += n;
+    used = n;
+
+    if (eof && !m_flushed) {
+      m_buf.insert(m_buf.end(), m_half, 0.0f);
+      m_flushed = true;
+    }
+
+    const int K = 2 * m_half;
+    long gen = 0;
+    while (gen < outlen) {
+      int64_t pos = m_next * m_M;
+      int64_t i = pos / m_L;
+      if (m_flushed ? (i >= m_total) : (i + m_half >= m_total))
+        break;
+
+      const float *x = &m_buf[(size_t)(i - m_half + 1 - m_base)];
+      const float *h = m_filter->GetPhase((long)(pos % m_L));
+
+      /* independent sums, so the loop maps onto vector lanes */
+      float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+      int j = 0;
+      for (; j + 3 < K; j += 4) {
+        s0 += x[j] * h[j];
+        s1 += x[j + 1] * h[j + 1];
+        s2 += x[j + 2] * h[j + 2];
+        s3 += x[j + 3] * h[j + 3];
+      }
+      for (; j < K; j++) {
+        s0 += x[j] * h[j];
+      }
+      out[gen++] = (s0 + s1) + (s2 + s3);
+      m_next++;
+    }
+
+    /* drop the samples no output needs anymore, once they outweigh the others */
+    int64_t first = (m_next * m_M) / m_L - m_half + 1;
+    size_t dead = (size_t)std::max<int64_t>(0, first - m_base);
+    if (dead > 4096 && dead > m_buf.size() / 2) {
+      m_buf.erase(m_buf.begin(), m_buf.begin() + dead);
+      m_base += dead;
+    }
+
+    return gen;
+  }
+
+private:
+  std::shared_ptr<const PolyphaseFilter> m_filter;
+  int64_t                                m_L;
+  int64_t                                m_M;
+  int                                    m_half;
+  std::vector<float>                     m_buf;      // input from sample m_base
+  int64_t                                m_base;
+  int64_t                                m_total;    // input samples fed
+  int64_t                                m_next;     // next output
+  bool                                   m_flushed;  // zeros after the last sample added
+};
+
+/* libsamplerate converter */
+class SrcResampler : public Resampler {
+public:
+  SrcResampler(long sr_in, long sr_out, ph_resample_quality quality, SRC_STATE *state)
+    : Resampler(sr_in, sr_out, quality)
+    , m_state{ state }
+    , m_ratio{ (double)sr_out / (double)sr_in } {}
+
+  ~SrcResampler() {
+    src_delete(m_state);
+  }
+
+  void Reset() override {
+    src_reset(m_state);
+  }
+
+  long Process(const float *in, long n, bool eof, float *out, long outlen, long &used) override {
+    SRC_DATA src_data;
+    src_data.data_in = in;
+    src_data.input_frames = n;
+    src_data.data_out = out;
+    src_data.output_frames = outlen;
+    src_data.end_of_input = eof ? 1 : 0;
+    src_data.src_ratio = m_ratio;
+
+    if (src_process(m_state, &src_data) != 0) {
+      used = 0;
+      return -1;
+    }
+
+    used = src_data.input_frames_used;
+    return src_data.output_frames_gen;
+  }
+
+private:
+  SRC_STATE* m_state;
+  double     m_ratio;
+};
+
+Resampler* create_resampler(long sr_in, long sr_out, ph_resample_quality quality) {
+  if (quality != PH_RESAMPLE_LINEAR) {
+    long g = gcd(sr_in, sr_out);
+    long L = sr_out / g;
+    long M = sr_in / g;
+    int zeros = (quality == PH_RESAMPLE_HIGH) ? 32 : 8;
+    int taps = 2 * (int)ceil(zeros / (PASS_BAND * std::min(1.0, (double)L / (double)M)));
+    if (L <= MAX_PHASES && L * taps <= MAX_TAPS) {
+      return new PolyphaseResampler(sr_in, sr_out, quality, PolyphaseFilter::Get(L, M, zeros));
+    }
+  }
+
+  /* libsamplerate for the linear quality, and the rates the built-in converter does not take */
+  if (src_is_valid_ratio((double)sr_out / (double)sr_in) == 0) {
+    return nullptr;
+  }
+
+  int converter = (quality == PH_RESAMPLE_LINEAR) ? SRC_LINEAR :
+                  (quality == PH_RESAMPLE_HIGH) ? SRC_SINC_MEDIUM_QUALITY : SRC_SINC_FASTEST;
+  int error;
+  SRC_STATE *state = src_new(converter, 1, &error);
+  if (!state) {
+    return nullptr;
+  }
+
+  return new SrcResampler(sr_in, sr_out, quality, state);
+}
+
+}
+
+Resampler* Resampler::Get(long sr_in, long sr_out, ph_resample_quality quality) {
+  static thread_local std::unique_ptr<Resampler> resampler;
+
+  if (sr_in <= 0 || sr_out <= 0) {
+    return nullptr;
+  }
+
+  if (resampler && resampler->m_srIn == sr_in && resampler->m_srOut == sr_out && resampler->m_quality == quality) {
+    resampler->Reset();
+  } else {
+    resampler.reset(create_resampler(sr_in, sr_out, quality));
+  }
+
+  return resampler.get();
+}
+
+#endif /* HAVE_AUDIO_HASH */